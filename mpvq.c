@@ -10,12 +10,18 @@
 #include <pthread.h>
 #include <math.h>
 #include <time.h>
+#include <fcntl.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
 
 #ifdef __linux__
+#include <sys/syscall.h>
 #include <linux/limits.h>
+#include <linux/io_uring.h>
 #include <bsd/bsd.h>
 #endif
 
@@ -29,6 +35,41 @@
 #define MIN_TERMINAL_WIDTH 35
 #define MIN_TERMINAL_HEIGHT 15
 #define MPVQ_PLIST_HEADER "_MPVQ_PLIST_"
+#define UI_TICK_MS 500
+#define FRAME_BUDGET_NS 16000000 /* min time between 2 frames while typing */
+#define INGEST_TICK_MS 50 /* how often the ui picks up streamed paths */
+#define INGEST_QUEUE 65536 /* paths read ahead of the ui */
+#define INGEST_BUDGET_NS 20000000 /* spent adding them per frame */
+#define INGEST_MAX_JOBS 4096 /* queued per song work, before ingest waits */
+#define LOUDNESS_QUEUE 64 /* songs queued up for analysis at a time */
+#define PREFETCH_CHUNK (1 << 20)
+#define PREFETCH_RATE (16 << 20) /* bytes per second */
+#define PREFETCH_MAX (256 << 20) /* per song */
+#define PREFETCH_PROBE (1 << 20) /* checked for being cached when loading */
+#define METRICS_INTERVAL 10 /* seconds */
+#define SESSION_INTERVAL 30 /* seconds */
+#define RECENT_MAX 64 /* songs the weighted random play won't pick again */
+#define SHUFFLE_TRIES 32 /* picks before giving up on avoiding those */
+#define WEIGHT_MAX_AGE 365 /* days, for songs never played */
+#define WEIGHT_REFRESH 3600 /* seconds the ages in the weights can lag */
+#define LIBRARY_INTERVAL 600 /* seconds between rescans of -l */
+#define N_TRIGRAMS (37 * 37 * 37) /* see tri_sym() */
+#define N_GRAMS (N_TRIGRAMS + 37 * 37 + 37) /* and pairs and characters */
+#define GRAM_SKIP 64 /* postings worth decoding per candidate left */
+#define TAG_MAX 256
+#define TAG_READ_MAX (1 << 20) /* bytes of tags read, cover art is skipped */
+#define QUERY_TERMS 32
+#define VALIDATE_INTERVAL 60 /* seconds */
+#define VALIDATE_BATCH 1024 /* playlist entries checked per job */
+#define MAX_FAILURES 8 /* songs in a row mpv can't play before stopping */
+#define SESSION_MAGIC "_MPVQ_SESSION_1_"
+#define MISSING_GONE ((void*)1)
+#define MISSING_FAILED ((void*)2)
+#define LIBRARY_MAGIC "_MPVQ_LIBRARY_1_"
+#define N_BUCKETS 10
+#define LOUDNESS_TARGET -18.0 /* LUFS, same reference level as replaygain 2.0 */
+#define LOUDNESS_MAX_GAIN 12.0 /* mpv's default volume-gain-max */
+#define LOUDNESS_MIN_GAIN -96.0 /* and volume-gain-min */
 
 #ifdef __OpenBSD__
 #define RAND_FUNCTION arc4random
@@ -36,10 +77,40 @@
 #define RAND_FUNCTION rand
 #endif
 
+#define ARENA_BLOCK (64 << 10)
+#define BENCH_SONGS 20000
+#define BENCH_WARMUP 100
+#define BENCH_FRAMES 20000
+#define HEADLESS_WIDTH 120 /* of the fake terminal for -b */
+#define HEADLESS_HEIGHT 40
+#define REPLAY_HEADER "_MPVQ_EVENTS_"
+
+/* every allocation made by mpvq itself (not by termbox or libmpv) is counted,
+ * per thread. the ui thread isn't supposed to allocate anything while just
+ * moving around and redrawing, -b checks that */
+static __thread unsigned long n_allocs = 0;
+
+static void *count_alloc(void *p) {
+  n_allocs++;
+  return p;
+}
+
+/* lock-free counters for the metrics */
+#define COUNT(x) __atomic_fetch_add(&(x), 1, __ATOMIC_RELAXED)
+#define LOAD(x)  __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+#undef strdup
+#undef strndup
+#define malloc(n)     count_alloc(malloc(n))
+#define calloc(n, s)  count_alloc(calloc(n, s))
+#define realloc(p, n) count_alloc(realloc(p, n))
+#define strdup(s)     count_alloc(strdup(s))
+#define strndup(s, n) count_alloc(strndup(s, n))
+
 static const char *music_file_extensions[] = {
-  "mp3", "wav", "ogg", "flac"
+  "mp3", "wav", "ogg", "flac", "opus"
 }; /* extensions of files recognised as sound files */
-static const int n_music_file_extensions = 4;
+static const int n_music_file_extensions = 5;
 
 /*  nw    n    ne
  *   +---------+
@@ -53,7 +124,8 @@ static const wchar_t *ascii_borderstr = L"-|-|++++";
 
 typedef enum {
   mode_fileexplorer,
-  mode_playlist
+  mode_playlist,
+  mode_library
 } mode;
 
 typedef enum {
@@ -62,14 +134,189 @@ typedef enum {
   state_nothing_playing
 } player_state;
 
+/* string -> pointer hash table, chained */
+typedef struct hent {
+  char *key;
+  void *val;
+  struct hent *next;
+} hent;
+
+typedef struct {
+  hent **b;
+  size_t n_b, n;
+} htab;
+
+/* queue of jobs eaten by a pool of worker threads */
+typedef struct job {
+  void (*fn)(void *);
+  void *arg;
+  struct job *next;
+} job;
+
+typedef struct {
+  pthread_mutex_t mtx;
+  pthread_cond_t cond;
+  pthread_cond_t idle; /* signalled when n_pending drops to 0 */
+  job *head, *tail;
+  int n_pending; /* queued + currently running */
+  int lowprio;   /* run the workers with idle cpu and i/o priority */
+} workq;
+
+typedef struct {
+  long long size, mtime; /* of the file when it was analyzed */
+  double lufs;           /* integrated loudness */
+  double peak;           /* sample peak in dBFS */
+} loudness;
+
+typedef struct {
+  long long size, mtime; /* of the file when it was probed */
+  double secs;
+} duration;
+
+typedef struct {
+  char *path;
+  double secs; /* < 0 if it couldn't be probed */
+} probe_result;
+
+typedef struct {
+  int plays; /* till the end */
+  int skips; /* with n */
+  time_t last; /* loaded */
+  double weight; /* for the weighted random play, as of weight_at */
+  time_t weight_at;
+} songstats;
+
+/* playlist entries for a worker to check for being there */
+typedef struct {
+  int n;
+  char *paths[VALIDATE_BATCH];
+} vbatch;
+
+/* start of ~/.mpvq_session. followed by NUL terminated strings: the cwd,
+ * then the playlist, then the file explorer listing */
+typedef struct {
+  char magic[16]; /* SESSION_MAGIC, without the NUL */
+  int32_t n_playlist, n_fileexplorer;
+  int32_t current_playing, pstate, mode;
+  int32_t playlist_cur, playlist_scroll;
+  int32_t fileexplorer_cur, fileexplorer_scroll;
+  double time_pos;
+} session_header;
+
+/* durations of the playlist entries by index, with a fenwick tree over them,
+ * so the time left can be summed without walking the whole playlist. also
+ * holds the weights of the weighted random play, so picking one is a walk
+ * down the tree */
+typedef struct {
+  double *d;     /* seconds, < 0 if not known (yet) */
+  double *tree;  /* 1-indexed, over max(d[i], 0) */
+  int n, cap;
+  int n_unknown;
+  double total;
+} durlist;
+
+typedef struct {
+  char *path;
+  long long len; /* of the audio payload */
+  long long dev, ino, mtime;
+  uint64_t hash; /* of the audio payload */
+  int hashed;    /* 0 if it couldn't be read */
+} dupfile;
+
+enum { dedup_check, dedup_register, dedup_reset };
+
+/* a song for the dedup_q worker to look at, with -d */
+typedef struct {
+  int kind;     /* dedup_* */
+  char *path;
+  unsigned gen; /* dedup_gen when it was queued */
+} dedupjob;
+
+/* first song of some audio length the dedup_q worker saw */
+typedef struct {
+  int hashed; /* and put into dup_hashes */
+  char path[];
+} dupfirst;
+
+/* prometheus style histogram of durations, updated without locks */
+typedef struct {
+  const double *le; /* N_BUCKETS upper bounds, in seconds */
+  uint64_t counts[N_BUCKETS + 1]; /* not cumulative. the last one is +Inf */
+  uint64_t sum_ns;
+} histogram;
+
+/* bump allocator for things that are all freed at once */
+typedef struct ablock {
+  struct ablock *next;
+  size_t size, used;
+  char data[];
+} ablock;
+
+typedef struct {
+  ablock *head;
+} arena;
+
 typedef struct {
   int scroll;         /* amount of elements scrolled */
   int cur;            /* element currently pointed at by cursor */
   int n_elems;        /* amount of elements in elems */
+  int cap;            /* amount of elements allocated for in elems */
   char **elems;       /* elements of the list */
+  arena strs;         /* where the elements are allocated from */
   int x1, y1, x2, y2; /* bounding rect of the list */
 } gui_list;
 
+typedef struct {
+  char title[TAG_MAX], artist[TAG_MAX], album[TAG_MAX];
+  int year; /* 0 if unknown */
+} tags;
+
+typedef struct {
+  char *path, *title, *artist, *album; /* tags are "" if missing */
+  long long size, mtime;
+  double secs; /* < 0 if unknown */
+  int year;    /* 0 if unknown */
+  int format;  /* index into music_file_extensions */
+} track;
+
+/* every song under -l, with an index of the trigrams, pairs and characters
+ * of their paths (below -l) and tags, and their ids sorted by year, duration
+ * and format. built by the scanner, owned by the ui once handed over */
+typedef struct {
+  track *tracks; /* sorted by path, the id of a track is its index */
+  int n, cap;
+  arena strs;
+  int *by_year, *by_secs, *by_format;
+  uint32_t gram_off[N_GRAMS + 1]; /* into postings */
+  uint32_t gram_count[N_GRAMS];
+  unsigned char *postings;
+} library;
+
+/* start of ~/.mpvq_library.idx, followed by the columns, gram_off,
+ * gram_count and the postings of the library in ~/.mpvq_library */
+typedef struct {
+  char magic[16]; /* LIBRARY_MAGIC, without the NUL */
+  int64_t cache_size, cache_mtime, cache_ino; /* of ~/.mpvq_library */
+  int32_t n;
+  uint32_t n_postings;
+} library_header;
+
+typedef struct {
+  double key;
+  int id;
+} colent;
+
+enum { q_any, q_path, q_title, q_artist, q_album, q_year, q_secs, q_format,
+  q_in };
+
+/* a term of a library query */
+typedef struct {
+  int field;  /* q_* */
+  int neg;
+  char *text; /* to look for, or the format */
+  double lo, hi; /* inclusive, for year: and dur:. format: as lo */
+} qterm;
+
 static int fileexplorer_width = -1;
 static int playlist_width     = -1;
 static int current_playing    = 0; /* "pointer" to currently playing song in */
@@ -80,7 +327,119 @@ static mpv_handle *ctx        = NULL;
 static mode current_mode      = mode_fileexplorer;
 static player_state pstate    = state_nothing_playing;
 static gui_list playlist;
+/* held by the ui thread while it changes the playlist or current_playing, and
+ * by the mpv event thread while it looks at them */
+static pthread_mutex_t playlist_mtx = PTHREAD_MUTEX_INITIALIZER;
 static gui_list fileexplorer;
+static arena frame; /* scratch memory for drawing a single frame */
+static htab loudness_cache;
+static htab loudness_queued; /* paths waiting for or being analyzed */
+static int loudness_fed = 0; /* playlist entries looked at for analysis */
+static workq loudness_q;
+static pthread_mutex_t loudness_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* appends to ~/.mpvq_loudness, apart so the ui never waits on the disk */
+static pthread_mutex_t loudness_file_mtx = PTHREAD_MUTEX_INITIALIZER;
+static htab playlist_index; /* path -> (index in playlist + 1) */
+static durlist playlist_durs;
+static htab duration_cache;
+static workq duration_q;
+static pthread_mutex_t duration_mtx = PTHREAD_MUTEX_INITIALIZER;
+static probe_result *probes_done = NULL; /* waiting for the ui thread */
+static int n_probes_done = 0;
+static double time_pos = 0; /* of the currently playing song, atomic */
+static htab hash_cache; /* "<dev> <ino> <mtime>" -> content hash */
+static workq hash_q;
+static pthread_mutex_t hash_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t hash_once = PTHREAD_ONCE_INIT;
+static workq dedup_q; /* a single worker, so songs are checked in order */
+static htab dup_paths;   /* songs the dedup_q worker knows of */
+static htab dup_lengths; /* "<audio length>" -> dupfirst */
+static htab dup_hashes;  /* "<audio length> <hash>" of songs that needed one */
+static pthread_mutex_t dedup_mtx = PTHREAD_MUTEX_INITIALIZER;
+static dedupjob **dedup_done = NULL; /* unique songs, waiting for the ui */
+static int n_dedup_done = 0, dedup_done_cap = 0;
+static int n_dedup_pending = 0; /* songs queued up for checking */
+static unsigned dedup_gen = 0; /* bumped when the playlist is cleared */
+static int dup_scan_running = 0;
+static int dup_report_ready = 0; /* set by the scan, cleared by the ui */
+static char dup_report[PATH_MAX + 128];
+static pthread_mutex_t prefetch_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static char **prefetch_list = NULL; /* waiting for the prefetcher */
+static int n_prefetch = 0;
+static unsigned prefetch_gen = 0; /* bumped to cancel the current read-ahead */
+static int n_warm_starts = 0; /* songs loaded when already in page cache */
+static int n_cold_starts = 0;
+static const double hist_buckets[N_BUCKETS] = { /* seconds */
+  0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.05, 0.25, 1
+};
+static const double scan_buckets[N_BUCKETS] = { /* a whole disk can take long */
+  0.01, 0.05, 0.1, 0.5, 1, 5, 10, 30, 60, 300
+};
+static uint64_t n_played = 0;  /* MPV_END_FILE_REASON_EOF */
+static uint64_t n_skipped = 0; /* with n */
+static uint64_t n_failed = 0;  /* MPV_END_FILE_REASON_ERROR */
+static histogram render_hist = { hist_buckets, { 0 }, 0 };
+static histogram mpv_cmd_hist = { hist_buckets, { 0 }, 0 };
+static histogram dir_scan_hist = { scan_buckets, { 0 }, 0 };
+static histogram dup_scan_hist = { scan_buckets, { 0 }, 0 };
+static pthread_mutex_t metrics_mtx = PTHREAD_MUTEX_INITIALIZER;
+static FILE *record_fp = NULL;
+static uint64_t record_start;
+static struct tb_event *replay_evs = NULL;
+static uint64_t *replay_ts = NULL; /* us since the start of the recording */
+static uint64_t replay_last; /* when the last event was handed out */
+static int n_replay_evs = 0, replay_pos = 0;
+static uint64_t *handle_lat = NULL; /* ns, one per replayed event */
+static uint64_t *render_lat = NULL;
+static int n_lat = 0;
+static int pty_master = -1; /* the other end of the headless terminal */
+static uint64_t pty_bytes = 0; /* written to the headless terminal */
+static pthread_mutex_t ingest_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ingest_cond = PTHREAD_COND_INITIALIZER;
+static char *ingest_ring[INGEST_QUEUE]; /* resolved paths, for the ui */
+static int ingest_head = 0, ingest_len = 0;
+static int ingesting = 0; /* until the end of the stream got read */
+static double resume_pos = 0; /* seeked to once the song is loaded */
+/* path -> MISSING_GONE for songs that aren't there, MISSING_FAILED for ones
+ * mpv couldn't play. only the former get dropped when they're back */
+static htab missing;
+static pthread_mutex_t missing_mtx = PTHREAD_MUTEX_INITIALIZER;
+static workq validate_q;
+static int n_validating = 0; /* batches left in the current pass */
+static char *validate_buf = NULL; /* copy of the paths of the current pass */
+static size_t validate_cap = 0;
+static vbatch *vbatches = NULL; /* reused by every pass */
+static int vbatches_cap = 0;
+static time_t last_validate = 0;
+static htab song_stats; /* path -> songstats */
+static int stats_read = 0; /* song_stats is only needed for -w */
+/* the rest of the weighted random play is under playlist_mtx too */
+static durlist shuffle_w; /* weights of the first entries, see sync_weights */
+static time_t weights_at = 0; /* when the ages in them were taken */
+static double unknown_weight; /* of songs without stats */
+static int next_pick = -1; /* song picked to play next, so it's prefetched */
+static uint64_t recent[RECENT_MAX]; /* hashes of the paths last loaded */
+static int n_recent = 0, recent_pos = 0;
+static char *back[RECENT_MAX]; /* paths last loaded, for N */
+static int n_back = 0, back_pos = 0;
+static size_t library_rootlen = 0; /* of -l, with the slash after it */
+static library *lib = NULL; /* ui thread only */
+static library *library_next = NULL; /* from the scanner, for the ui */
+static pthread_mutex_t library_mtx = PTHREAD_MUTEX_INITIALIZER;
+static gui_list results; /* of the last library query */
+static int *result_ids = NULL; /* ids of the tracks in results */
+static int *cand_buf = NULL, *tmp_buf = NULL;
+static unsigned *query_marks = NULL; /* == query_gen if a track's ruled out */
+static unsigned query_gen = 0;
+static int results_cap = 0;
+static char *last_query = NULL;
+static double query_ms;
+static time_t last_session_save;
+static int session_dirty = 1; /* lists changed since the session was saved */
+static session_header saved_header; /* as last written */
+static ino_t session_ino; /* of the file it was written to */
+static off_t session_size;
 
 /* HACK: why isn't this a function */
 #define check_file_error() \
@@ -121,6 +480,17 @@ static gui_list fileexplorer;
 /* flags */
 static int aflag;
 static int nflag;
+static int gflag;
+static int dflag;
+static int prefetch_count = 0; /* -p */
+static int bflag;
+static int zflag; /* -0 */
+static char *metrics_path = NULL; /* -m */
+static char *record_path = NULL; /* -r */
+static char *replay_path = NULL; /* -R */
+static char *library_root = NULL; /* -l */
+static int wflag; /* weighted random play, -w or w */
+static double weight_plays = 0.5, weight_skips = 1, weight_age = 0.5; /* -w */
 
 static inline void exit_if_term_to_small() {
   if (tb_width() < MIN_TERMINAL_WIDTH || tb_height() < MIN_TERMINAL_HEIGHT) {
@@ -148,42 +518,429 @@ static void histwrite(char *fmt, ...) {
   fclose(fp);
 }
 
-static void play_song(char *path) {
-  const char *command_load[] = { "loadfile", path, NULL },
-             *command_play[] = { "set", "pause", "no", NULL };
+static void *arena_alloc(arena *a, size_t n) {
+  ablock *b = a->head;
+  size_t size;
+
+  n = (n + 7) & ~(size_t)7;
+  if (!b || b->used + n > b->size) {
+    size = b ? b->size * 2 : ARENA_BLOCK;
+    size = size < n ? n : size;
+    b = malloc(sizeof(ablock) + size);
+    b->next = a->head;
+    b->size = size;
+    b->used = 0;
+    a->head = b;
+  }
 
-  if (path) {
-    mpv_command(ctx, command_load);
-    histwrite("LOAD %s", path);
-  } else
-    mpv_command(ctx, command_play);
+  b->used += n;
+  return b->data + b->used - n;
 }
 
-static void pause_song() {
-  const char *command[] = { "set", "pause", "yes", NULL };
+static char *arena_strdup(arena *a, const char *s) {
+  size_t len = strlen(s) + 1;
+  return memcpy(arena_alloc(a, len), s, len);
+}
+
+static void arena_free(arena *a) {
+  ablock *b, *next;
 
-  mpv_command(ctx, command);
+  for (b = a->head; b; b = next) {
+    next = b->next;
+    free(b);
+  }
+  a->head = NULL;
 }
 
-static void *event_waiter(void *_) {
-  mpv_event *ev;
-  (void)_;
+/* frees everything at once. what's left is a single block big enough for
+ * all that was in use, so an arena that keeps getting filled up the same way
+ * stops allocating after the first time */
+static void arena_reset(arena *a) {
+  ablock *b, *next;
+  size_t total = 0;
+
+  if (!a->head)
+    return;
+
+  if (a->head->next) {
+    for (b = a->head; b; b = next) {
+      next = b->next;
+      total += b->size;
+      free(b);
+    }
+    a->head = malloc(sizeof(ablock) + total);
+    a->head->next = NULL;
+    a->head->size = total;
+  }
+  a->head->used = 0;
+}
+
+static uint64_t fnv1a(const void *p, size_t len) {
+  const unsigned char *s = p;
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (len--) {
+    h ^= *s++;
+    h *= 0x100000001b3ULL;
+  }
+
+  return h;
+}
+
+static hent **hfind(htab *h, const char *key) {
+  hent **e;
+
+  if (h->n_b == 0)
+    return NULL;
+
+  e = &h->b[fnv1a(key, strlen(key)) & (h->n_b - 1)];
+  while (*e && strcmp((*e)->key, key) != 0)
+    e = &(*e)->next;
+
+  return e;
+}
+
+static void *hget(htab *h, const char *key) {
+  hent **e = hfind(h, key);
+  return e && *e ? (*e)->val : NULL;
+}
+
+/* returns the value that got replaced (or NULL), so the caller can free it */
+static void *hput(htab *h, const char *key, void *val) {
+  hent **e, *ent, *next, **nb;
+  size_t i, nn;
+  void *old;
+
+  if (h->n >= h->n_b) { /* grow x2 and rehash */
+    nn = h->n_b ? h->n_b * 2 : 64;
+    nb = calloc(nn, sizeof(hent*));
+    for (i = 0; i < h->n_b; ++i)
+      for (ent = h->b[i]; ent; ent = next) {
+        next = ent->next;
+        e = &nb[fnv1a(ent->key, strlen(ent->key)) & (nn - 1)];
+        ent->next = *e;
+        *e = ent;
+      }
+    free(h->b);
+    h->b = nb;
+    h->n_b = nn;
+  }
+
+  e = hfind(h, key);
+  if (*e) {
+    old = (*e)->val;
+    (*e)->val = val;
+    return old;
+  }
+
+  ent = malloc(sizeof(hent));
+  ent->key = strdup(key);
+  ent->val = val;
+  ent->next = NULL;
+  *e = ent;
+  h->n++;
+
+  return NULL;
+}
+
+/* returns the value of the removed entry (or NULL) */
+static void *hdel(htab *h, const char *key) {
+  hent **e = hfind(h, key), *ent;
+  void *val;
+
+  if (!e || !*e)
+    return NULL;
+
+  ent = *e;
+  *e = ent->next;
+  val = ent->val;
+  free(ent->key);
+  free(ent);
+  h->n--;
+
+  return val;
+}
+
+static void hclear(htab *h, int free_vals) {
+  hent *e, *next;
+  size_t i;
+
+  for (i = 0; i < h->n_b; ++i)
+    for (e = h->b[i]; e; e = next) {
+      next = e->next;
+      if (free_vals)
+        free(e->val);
+      free(e->key);
+      free(e);
+    }
+
+  free(h->b);
+  h->b = NULL;
+  h->n_b = h->n = 0;
+}
+
+/* so background work doesn't fight with playback for cpu and disk */
+static void lower_thread_priority(void) {
+#ifdef __linux__
+  /* on linux both of these are per-thread, and are inherited by threads
+   * created from this one (e.g. by a mpv_handle) */
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+  syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0,
+      3 << 13 /* IOPRIO_CLASS_IDLE */);
+#endif
+}
+
+static void *workq_worker(void *arg) {
+  workq *q = arg;
+  job *j;
+
+  if (q->lowprio)
+    lower_thread_priority();
+
   while (1) {
-    ev = mpv_wait_event(ctx, 1000);
+    pthread_mutex_lock(&q->mtx);
+    while (q->head == NULL)
+      pthread_cond_wait(&q->cond, &q->mtx);
+    j = q->head;
+    q->head = j->next;
+    if (q->head == NULL)
+      q->tail = NULL;
+    pthread_mutex_unlock(&q->mtx);
+
+    j->fn(j->arg);
+    free(j);
+
+    pthread_mutex_lock(&q->mtx);
+    if (--q->n_pending == 0)
+      pthread_cond_broadcast(&q->idle);
+    pthread_mutex_unlock(&q->mtx);
+  }
+
+  return NULL;
+}
+
+/* n_workers <= 0 means one worker per cpu */
+static void workq_init(workq *q, int n_workers, int lowprio) {
+  pthread_t thr;
+  int i;
+
+  if (n_workers <= 0)
+    n_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_workers <= 0)
+    n_workers = 1;
+
+  pthread_mutex_init(&q->mtx, NULL);
+  pthread_cond_init(&q->cond, NULL);
+  pthread_cond_init(&q->idle, NULL);
+  q->head = q->tail = NULL;
+  q->n_pending = 0;
+  q->lowprio = lowprio;
+
+  for (i = 0; i < n_workers; ++i) {
+    pthread_create(&thr, NULL, workq_worker, q);
+    pthread_detach(thr);
+  }
+}
+
+/* block until everything pushed so far is done */
+static void workq_wait(workq *q) {
+  pthread_mutex_lock(&q->mtx);
+  while (q->n_pending > 0)
+    pthread_cond_wait(&q->idle, &q->mtx);
+  pthread_mutex_unlock(&q->mtx);
+}
+
+static int workq_pending(workq *q) {
+  int n;
+
+  pthread_mutex_lock(&q->mtx);
+  n = q->n_pending;
+  pthread_mutex_unlock(&q->mtx);
+
+  return n;
+}
+
+static void workq_push(workq *q, void (*fn)(void *), void *arg) {
+  job *j = malloc(sizeof(job));
+
+  j->fn = fn;
+  j->arg = arg;
+  j->next = NULL;
+
+  pthread_mutex_lock(&q->mtx);
+  if (q->tail)
+    q->tail->next = j;
+  else
+    q->head = j;
+  q->tail = j;
+  q->n_pending++;
+  pthread_cond_signal(&q->cond);
+  pthread_mutex_unlock(&q->mtx);
+}
+
+/* loudness cache lives in ~/.mpvq_loudness, one analyzed file per line:
+ *   <size> <mtime> <integrated lufs> <peak dBFS> <path>
+ * it's appended to while running, later lines win. that's what makes the
+ * analysis resumable - whatever finished before mpvq quit doesn't get
+ * analyzed again. the lines that lost get dropped when it's read */
+static void loudness_cache_path(char *loc) {
+  snprintf(loc, PATH_MAX, "%s/.mpvq_loudness", getenv("HOME"));
+}
+
+static void loudness_put(char *path, long long size, long long mtime,
+    double lufs, double peak) {
+  loudness *l = malloc(sizeof(loudness));
+
+  l->size = size;
+  l->mtime = mtime;
+  l->lufs = lufs;
+  l->peak = peak;
+  free(hput(&loudness_cache, path, l));
+}
+
+/* rewrites the cache with a line per file, through a temporary file */
+static void write_loudness_cache(void) {
+  char loc[PATH_MAX], tmp[PATH_MAX];
+  loudness *l;
+  hent *e;
+  size_t i;
+  FILE *fp;
+
+  loudness_cache_path(loc);
+  snprintf(tmp, PATH_MAX, "%s.tmp", loc);
+  if ((fp = fopen(tmp, "w")) == NULL)
+    return;
+
+  for (i = 0; i < loudness_cache.n_b; ++i)
+    for (e = loudness_cache.b[i]; e; e = e->next) {
+      l = e->val;
+      fprintf(fp, "%lld %lld %.2f %.2f %s\n", l->size, l->mtime, l->lufs,
+          l->peak, e->key);
+    }
+
+  if (fclose(fp) == 0)
+    rename(tmp, loc);
+  else
+    unlink(tmp);
+}
+
+static void read_loudness_cache(void) {
+  char loc[PATH_MAX], buf[PATH_MAX + 128];
+  long long size, mtime;
+  double lufs, peak;
+  size_t n_lines = 0;
+  int n;
+  FILE *fp;
+
+  loudness_cache_path(loc);
+  fp = fopen(loc, "r");
+  if (!fp) return; /* nothing analyzed yet */
+
+  while (fgets(buf, sizeof(buf), fp)) {
+    buf[strcspn(buf, "\n")] = 0;
+    n_lines++;
+    if (sscanf(buf, "%lld %lld %lf %lf %n", &size, &mtime, &lufs, &peak, &n)
+        == 4 && buf[n])
+      loudness_put(buf + n, size, mtime, lufs, peak);
+  }
+
+  fclose(fp);
+
+  /* mostly songs that got analyzed again after they changed */
+  if (n_lines > 2 * loudness_cache.n)
+    write_loudness_cache();
+}
+
+static void loudness_store(char *path, struct stat *st, double lufs,
+    double peak) {
+  char loc[PATH_MAX];
+  FILE *fp;
+
+  pthread_mutex_lock(&loudness_mtx);
+  loudness_put(path, st->st_size, st->st_mtime, lufs, peak);
+  pthread_mutex_unlock(&loudness_mtx);
+
+  loudness_cache_path(loc);
+  pthread_mutex_lock(&loudness_file_mtx);
+  if ((fp = fopen(loc, "a")) != NULL) {
+    fprintf(fp, "%lld %lld %.2f %.2f %s\n", (long long)st->st_size,
+        (long long)st->st_mtime, lufs, peak, path);
+    fclose(fp);
+  }
+  pthread_mutex_unlock(&loudness_file_mtx);
+}
+
+/* NULL if <path> wasn't analyzed or changed since. must hold loudness_mtx */
+static loudness *loudness_lookup(char *path, struct stat *st) {
+  loudness *l = hget(&loudness_cache, path);
+
+  if (l && l->size == st->st_size && l->mtime == st->st_mtime)
+    return l;
+  return NULL;
+}
+
+/* runs on a loudness_q worker. decodes <arg> as fast as possible through a
+ * headless mpv with ffmpeg's ebur128 filter and reads its results at eof */
+static void analyze_loudness(void *arg) {
+  char *path = arg, *key;
+  const char *command[] = { "loadfile", path, NULL };
+  double lufs = NAN, peak = NAN;
+  int i, no = 0, done;
+  struct stat st;
+  mpv_handle *h;
+  mpv_event *ev;
+  mpv_event_property *prop;
+  mpv_node meta;
+
+  if (stat(path, &st) < 0)
+    goto end;
+
+  pthread_mutex_lock(&loudness_mtx);
+  done = loudness_lookup(path, &st) != NULL;
+  pthread_mutex_unlock(&loudness_mtx);
+  if (done || (h = mpv_create()) == NULL)
+    goto end;
+
+  mpv_set_option_string(h, "ao", "null");
+  mpv_set_option_string(h, "ao-null-untimed", "yes");
+  mpv_set_option_string(h, "vid", "no");
+  mpv_set_option_string(h, "keep-open", "yes"); /* keep the filter at eof */
+  mpv_set_option_string(h, "af", "@lufs:lavfi=[ebur128=peak=sample:metadata=1]");
+  mpv_set_option(h, "audio-display", MPV_FORMAT_FLAG, &no);
+  if (mpv_initialize(h) < 0)
+    goto destroy;
+
+  mpv_observe_property(h, 0, "eof-reached", MPV_FORMAT_FLAG);
+  mpv_command(h, command);
+
+  while (!done) {
+    ev = mpv_wait_event(h, -1);
     switch (ev->event_id) {
-      case MPV_EVENT_END_FILE:
-        /* this took a while */
-        if (((mpv_event_end_file*)ev->data)->reason != MPV_END_FILE_REASON_EOF)
+      case MPV_EVENT_END_FILE: /* with keep-open this only means an error */
+      case MPV_EVENT_SHUTDOWN:
+        done = 1;
+        break;
+      case MPV_EVENT_PROPERTY_CHANGE:
+        prop = ev->data;
+        if (prop->format != MPV_FORMAT_FLAG || !*(int*)prop->data)
           break;
 
-        histwrite("EOF %s", playlist.elems[current_playing]);
-        if (current_playing + 1 < playlist.n_elems) {
-          current_playing++;
-          play_song(playlist.elems[current_playing]);
-        } else {
-          pstate = state_nothing_playing;
-          current_playing = 0;
+        if (mpv_get_property(h, "af-metadata/lufs", MPV_FORMAT_NODE, &meta)
+            >= 0) {
+          if (meta.format == MPV_FORMAT_NODE_MAP)
+            for (i = 0; i < meta.u.list->num; ++i) {
+              if (meta.u.list->values[i].format != MPV_FORMAT_STRING)
+                continue;
+              key = meta.u.list->keys[i];
+              if (strcmp(key, "lavfi.r128.I") == 0)
+                lufs = atof(meta.u.list->values[i].u.string);
+              else if (strcmp(key, "lavfi.r128.sample_peak") == 0)
+                /* it's linear, not in dB like the rest of them */
+                peak = 20 * log10(atof(meta.u.list->values[i].u.string));
+            }
+          mpv_free_node_contents(&meta);
         }
+        done = 1;
         break;
       default:
         (void)0;
@@ -191,228 +948,3717 @@ static void *event_waiter(void *_) {
     }
   }
 
-  return NULL;
+destroy:
+  mpv_terminate_destroy(h);
+  if (!isnan(lufs) && !isinf(lufs))
+    loudness_store(path, &st, lufs, isnan(peak) || isinf(peak) ? 0 : peak);
+end:
+  pthread_mutex_lock(&loudness_mtx);
+  hdel(&loudness_queued, path);
+  pthread_mutex_unlock(&loudness_mtx);
+  free(path);
 }
 
-static pthread_t *init_mpv() {
-  int no = 0;
-  pthread_t *thr = malloc(sizeof(pthread_t));;
+/* queues <path> up for analysis, unless it already is */
+static void loudness_enqueue(char *path) {
+  int queued;
 
-  ctx = mpv_create();
-  if (!ctx)
-    errx(1, "mpv_create() failed");
+  if (!gflag)
+    return;
 
-  mpv_set_option(ctx, "audio-display", MPV_FORMAT_FLAG, &no);
-  mpv_initialize(ctx);
+  pthread_mutex_lock(&loudness_mtx);
+  if (!(queued = hget(&loudness_queued, path) != NULL))
+    hput(&loudness_queued, path, (void*)1);
+  pthread_mutex_unlock(&loudness_mtx);
 
-  pthread_create(thr, NULL, event_waiter, NULL);
+  if (!queued)
+    workq_push(&loudness_q, analyze_loudness, strdup(path));
+}
 
-  return thr;
+/* set volume-gain so <path> plays at LOUDNESS_TARGET without clipping.
+ * tracks that weren't analyzed (yet) play at 0dB and get queued */
+static void apply_gain(char *path) {
+  double gain = 0;
+  struct stat st;
+  loudness *l = NULL;
+
+  if (!gflag || stat(path, &st) < 0)
+    return;
+
+  pthread_mutex_lock(&loudness_mtx);
+  if ((l = loudness_lookup(path, &st)) != NULL)
+    gain = fmin(LOUDNESS_TARGET - l->lufs, -l->peak);
+  pthread_mutex_unlock(&loudness_mtx);
+
+  if (!l)
+    loudness_enqueue(path);
+
+  gain = fmax(fmin(gain, LOUDNESS_MAX_GAIN), LOUDNESS_MIN_GAIN);
+  if (ctx) /* NULL when replaying */
+    mpv_set_property(ctx, "volume-gain", MPV_FORMAT_DOUBLE, &gain);
 }
 
-void swap(void **a, void **b) {
-  void *tmp = *a;
-  *a = *b;
-  *b = tmp;
+static void init_loudness(void) {
+  read_loudness_cache();
+  workq_init(&loudness_q, 0, 1);
 }
 
-/* https://github.com/krzysckh/shuf/blob/master/shuf.c */
-void shuf(void **a, int len) {
+static uint64_t now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void hist_observe(histogram *h, uint64_t ns) {
   int i;
 
-  for (i = len - 1; i > 0; --i)
-    swap(&a[(unsigned)RAND_FUNCTION() % len], &a[i]);
+  for (i = 0; i < N_BUCKETS && ns > h->le[i] * 1e9; ++i)
+    ;
+  COUNT(h->counts[i]);
+  __atomic_fetch_add(&h->sum_ns, ns, __ATOMIC_RELAXED);
 }
 
-/* less cursed implementation:
- * https://rosettacode.org/wiki/Levenshtein_distance#C
- */
+/* mpv_command(), timed for the metrics */
+static int mpv_cmd(const char **command) {
+  uint64_t start;
+  int rv;
 
-static int search_compar(const void *v1, const void *v2) {
-  char *o1 = strcasestr(*(char**)v1, search_buffer),
-       *o2 = strcasestr(*(char**)v2, search_buffer);
+  if (!ctx) /* replaying, there's no mpv */
+    return 0;
+  if (!metrics_path)
+    return mpv_command(ctx, command);
 
-  if (o1 && o2) return 0;
-  if (o1 && !o2) return -1;
-  if (!o1 && o2) return 1;
+  start = now_ns();
+  rv = mpv_command(ctx, command);
+  hist_observe(&mpv_cmd_hist, now_ns() - start);
 
-  return -1 + (RAND_FUNCTION()) % 2;
+  return rv;
 }
 
-/* i didn't like how strcoll() sorted my stuff :( */
-static int alphabetical(const void *v1, const void *v2) {
-  const char *s1 = *(char**)v1,
-             *s2 = *(char**)v2;
+static void write_histogram(FILE *fp, char *name, char *labels,
+    histogram *h) {
+  uint64_t total = 0;
+  int i;
 
-  if (s1[0] == '.' && s1[1] == '.') return -1;
-  if (s2[0] == '.' && s2[1] == '.') return 1;
-  if (*s1 && *s2) {
-    if (tolower(*s1) > tolower(*s2))
-      return 1;
-    else if (tolower(*s1) < tolower(*s2))
-      return -1;
-    else {
-      ++s1, ++s2;
-      return alphabetical(&s1, &s2);
-    }
-  } else {
-    if (!*s1 && !*s2)
-      return 0;
-    if (!*s1)
-      return -1;
-    return 1;
+  for (i = 0; i <= N_BUCKETS; ++i) {
+    total += LOAD(h->counts[i]);
+    if (i < N_BUCKETS)
+      fprintf(fp, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels,
+          *labels ? "," : "", h->le[i], (unsigned long long)total);
+    else
+      fprintf(fp, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels,
+          *labels ? "," : "", (unsigned long long)total);
   }
+  fprintf(fp, "%s_sum%s%s%s %.9f\n", name, *labels ? "{" : "", labels,
+      *labels ? "}" : "", LOAD(h->sum_ns) / 1e9);
+  fprintf(fp, "%s_count%s%s%s %llu\n", name, *labels ? "{" : "", labels,
+      *labels ? "}" : "", (unsigned long long)total);
 }
 
-static char *getext(char *path) {
-  char *p = strrchr(path, '.');
-  return p ? ++p : p;
+/* rewrites <metrics_path> in the prometheus text format. it's written to a
+ * temporary file first and renamed over, so a scrape never sees half of it.
+ * the writer thread and the one on exit take turns */
+static void write_metrics(void) {
+  char tmp[PATH_MAX];
+  long long rss = -1, pages;
+  FILE *fp, *statm;
+
+  pthread_mutex_lock(&metrics_mtx);
+  snprintf(tmp, PATH_MAX, "%s.tmp", metrics_path);
+  if ((fp = fopen(tmp, "w")) == NULL) {
+    pthread_mutex_unlock(&metrics_mtx);
+    return;
+  }
+
+  if ((statm = fopen("/proc/self/statm", "r")) != NULL) { /* linux only */
+    if (fscanf(statm, "%*lld %lld", &pages) == 1)
+      rss = pages * sysconf(_SC_PAGESIZE);
+    fclose(statm);
+  }
+
+  fprintf(fp, "# HELP mpvq_tracks_played_total songs played until the end.\n"
+      "# TYPE mpvq_tracks_played_total counter\n"
+      "mpvq_tracks_played_total %llu\n",
+      (unsigned long long)LOAD(n_played));
+  fprintf(fp, "# HELP mpvq_tracks_skipped_total songs skipped with n.\n"
+      "# TYPE mpvq_tracks_skipped_total counter\n"
+      "mpvq_tracks_skipped_total %llu\n",
+      (unsigned long long)LOAD(n_skipped));
+  fprintf(fp, "# HELP mpvq_tracks_failed_total songs mpv couldn't play.\n"
+      "# TYPE mpvq_tracks_failed_total counter\n"
+      "mpvq_tracks_failed_total %llu\n",
+      (unsigned long long)LOAD(n_failed));
+  fprintf(fp, "# HELP mpvq_playlist_size songs in the playlist.\n"
+      "# TYPE mpvq_playlist_size gauge\n"
+      "mpvq_playlist_size %d\n", LOAD(playlist.n_elems));
+  if (rss >= 0)
+    fprintf(fp, "# HELP mpvq_resident_memory_bytes resident set size.\n"
+        "# TYPE mpvq_resident_memory_bytes gauge\n"
+        "mpvq_resident_memory_bytes %lld\n", rss);
+
+  fprintf(fp, "# HELP mpvq_render_duration_seconds time to draw a frame.\n"
+      "# TYPE mpvq_render_duration_seconds histogram\n");
+  write_histogram(fp, "mpvq_render_duration_seconds", "", &render_hist);
+  fprintf(fp, "# HELP mpvq_mpv_command_duration_seconds time spent in "
+      "mpv_command().\n"
+      "# TYPE mpvq_mpv_command_duration_seconds histogram\n");
+  write_histogram(fp, "mpvq_mpv_command_duration_seconds", "",
+      &mpv_cmd_hist);
+  fprintf(fp, "# HELP mpvq_scan_duration_seconds time to read a directory "
+      "(dir) or to look for duplicate songs (duplicates).\n"
+      "# TYPE mpvq_scan_duration_seconds histogram\n");
+  write_histogram(fp, "mpvq_scan_duration_seconds", "kind=\"dir\"",
+      &dir_scan_hist);
+  write_histogram(fp, "mpvq_scan_duration_seconds", "kind=\"duplicates\"",
+      &dup_scan_hist);
+
+  if (fclose(fp) == 0)
+    rename(tmp, metrics_path);
+  else
+    unlink(tmp);
+  pthread_mutex_unlock(&metrics_mtx);
 }
 
-static int is_music_ext(char *path) {
-  char *ext = getext(path);
-  int i;
+static void *metrics_writer(void *_) {
+  (void)_;
 
-  if (ext) /* getext returns NULL when file has no extension */
-    for (i = 0; i < n_music_file_extensions; ++i)
-      if (strcmp(music_file_extensions[i], ext) == 0)
-        return 1;
-  return 0;
+  while (1) {
+    write_metrics();
+    sleep(METRICS_INTERVAL);
+  }
+
+  return NULL;
 }
 
-static int is_dir(char *path) {
-  struct stat s;
-  stat(path, &s);
-  return S_ISDIR(s.st_mode);
+static void init_metrics(void) {
+  pthread_t thr;
+
+  pthread_create(&thr, NULL, metrics_writer, NULL);
+  pthread_detach(thr);
 }
 
-// fancy, no clue why
-static int is_directory(char *path) {
-  char *realpath = alloca(strlen(cwd) + strlen(path) + 2);
-  sprintf(realpath, "%s%s/", cwd, path);
+static int prefetch_cancelled(unsigned gen) {
+  int rv;
+
+  pthread_mutex_lock(&prefetch_mtx);
+  rv = gen != prefetch_gen;
+  pthread_mutex_unlock(&prefetch_mtx);
 
-  return is_dir(realpath);
+  return rv;
 }
 
-static void draw_outline(char* title, int x1, int y1, int x2, int y2) {
-  const wchar_t *bs = aflag ? ascii_borderstr : utf8_borderstr,
+/* reads <path> into the page cache, at most PREFETCH_RATE bytes a second so
+ * it doesn't starve the song that's playing now */
+static void prefetch_file(char *path, unsigned gen, char *buf) {
+  struct timespec start, now, ts;
+  double ahead;
+  ssize_t n;
+  off_t off = 0;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return;
+
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (off < PREFETCH_MAX && !prefetch_cancelled(gen)) {
+    if ((n = read(fd, buf, PREFETCH_CHUNK)) <= 0)
+      break;
+    off += n;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ahead = (double)off / PREFETCH_RATE - (now.tv_sec - start.tv_sec)
+      - (now.tv_nsec - start.tv_nsec) / 1e9;
+    if (ahead > 0) {
+      ts.tv_sec = ahead;
+      ts.tv_nsec = (ahead - ts.tv_sec) * 1e9;
+      nanosleep(&ts, NULL);
+    }
+  }
+
+  close(fd);
+}
+
+static void *prefetcher(void *_) {
+  char **list, *buf = malloc(PREFETCH_CHUNK);
+  unsigned gen;
+  int i, n;
+  (void)_;
+
+  lower_thread_priority();
+  while (1) {
+    pthread_mutex_lock(&prefetch_mtx);
+    while (prefetch_list == NULL)
+      pthread_cond_wait(&prefetch_cond, &prefetch_mtx);
+    list = prefetch_list;
+    n = n_prefetch;
+    gen = prefetch_gen;
+    prefetch_list = NULL;
+    pthread_mutex_unlock(&prefetch_mtx);
+
+    for (i = 0; i < n; ++i) {
+      if (!prefetch_cancelled(gen))
+        prefetch_file(list[i], gen, buf);
+      free(list[i]);
+    }
+    free(list);
+  }
+
+  return NULL;
+}
+
+static void init_prefetch(void) {
+  pthread_t thr;
+
+  pthread_create(&thr, NULL, prefetcher, NULL);
+  pthread_detach(thr);
+}
+
+/* cancel whatever is being read ahead, and start on the songs after
+ * current_playing, or on next_pick when playing weighted. called whenever
+ * those or the playlist order change, with playlist_mtx held */
+static void prefetch_kick(void) {
+  char **list = NULL;
+  int i, n, first = current_playing + 1;
+
+  if (!prefetch_count)
+    return;
+
+  n = playlist.n_elems - first;
+  n = n > prefetch_count ? prefetch_count : n;
+  if (wflag) { /* only the next one is known */
+    first = next_pick;
+    n = next_pick >= 0;
+  }
+  if (n > 0) {
+    list = malloc(sizeof(char*) * n);
+    for (i = 0; i < n; ++i)
+      list[i] = strdup(playlist.elems[first + i]);
+  }
+
+  pthread_mutex_lock(&prefetch_mtx);
+  if (prefetch_list) { /* never got picked up */
+    for (i = 0; i < n_prefetch; ++i)
+      free(prefetch_list[i]);
+    free(prefetch_list);
+  }
+  prefetch_list = list;
+  n_prefetch = n;
+  prefetch_gen++;
+  pthread_cond_signal(&prefetch_cond);
+  pthread_mutex_unlock(&prefetch_mtx);
+}
+
+/* 1 if the beginning of <path> is in the page cache, so mpv won't have to
+ * wait for the disk to start playing it. -1 if that can't be told */
+static int is_cached(char *path) {
+#ifdef __linux__
+  unsigned char vec[PREFETCH_PROBE / 4096 + 1];
+  struct stat st;
+  size_t len, i, pgsz = sysconf(_SC_PAGESIZE);
+  void *p;
+  int fd, rv = 1;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  fstat(fd, &st);
+  len = st.st_size < PREFETCH_PROBE ? (size_t)st.st_size : PREFETCH_PROBE;
+  if (len == 0 || pgsz < 4096
+      || (p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  if (mincore(p, len, vec) < 0)
+    rv = -1;
+  for (i = 0; rv == 1 && i < (len + pgsz - 1) / pgsz; ++i)
+    if (!(vec[i] & 1))
+      rv = 0;
+
+  munmap(p, len);
+  close(fd);
+  return rv;
+#else
+  (void)path;
+  return -1;
+#endif
+}
+
+static int is_missing(char *path) {
+  int rv;
+
+  pthread_mutex_lock(&missing_mtx);
+  rv = hget(&missing, path) != NULL;
+  pthread_mutex_unlock(&missing_mtx);
+
+  return rv;
+}
+
+/* first entry from <i> on (going by <dir>) that isn't missing, -1 if none */
+static int next_playable(int i, int dir) {
+  while (i >= 0 && i < playlist.n_elems && is_missing(playlist.elems[i]))
+    i += dir;
+
+  return i >= 0 && i < playlist.n_elems ? i : -1;
+}
+
+static void durlist_add(durlist *dl, int i, double v) {
+  for (++i; i <= dl->n; i += i & -i)
+    dl->tree[i] += v;
+}
+
+/* sum of the known durations of [0, i) */
+static double durlist_prefix(durlist *dl, int i) {
+  double sum = 0;
+
+  for (; i > 0; i -= i & -i)
+    sum += dl->tree[i];
+
+  return sum;
+}
+
+/* the entry whose span holds <x>, going down the tree. entries of 0 are
+ * never it */
+static int durlist_find(durlist *dl, double x) {
+  int i = 0, step;
+
+  for (step = 1; step * 2 <= dl->n; step *= 2)
+    ;
+  for (; step; step /= 2)
+    if (i + step <= dl->n && dl->tree[i + step] <= x) {
+      i += step;
+      x -= dl->tree[i];
+    }
+
+  return i < dl->n ? i : dl->n - 1; /* x was rounded up to the total */
+}
+
+static void durlist_set(durlist *dl, int i, double secs) {
+  double old = dl->d[i];
+
+  dl->n_unknown += (secs < 0) - (old < 0);
+  dl->d[i] = secs;
+  durlist_add(dl, i, fmax(secs, 0) - fmax(old, 0));
+  dl->total += fmax(secs, 0) - fmax(old, 0);
+}
+
+static void durlist_push(durlist *dl, double secs) {
+  int i, lsb;
+
+  if (dl->n + 1 >= dl->cap) {
+    dl->cap = dl->cap ? dl->cap * 2 : 256;
+    dl->d = realloc(dl->d, sizeof(double) * dl->cap);
+    dl->tree = realloc(dl->tree, sizeof(double) * (dl->cap + 1));
+  }
+
+  /* a new last node covers (i - lsb, i], the part before it is a prefix */
+  i = ++dl->n;
+  lsb = i & -i;
+  dl->d[i - 1] = -1;
+  dl->tree[i] = durlist_prefix(dl, i - 1) - durlist_prefix(dl, i - lsb);
+  dl->n_unknown++;
+  durlist_set(dl, i - 1, secs);
+}
+
+/* O(n) rebuild, for after the whole playlist got reordered */
+static void durlist_rebuild(durlist *dl) {
+  int i, j;
+
+  dl->total = 0;
+  dl->n_unknown = 0;
+  for (i = 1; i <= dl->n; ++i)
+    dl->tree[i] = 0;
+  for (i = 1; i <= dl->n; ++i) {
+    dl->tree[i] += fmax(dl->d[i - 1], 0);
+    dl->total += fmax(dl->d[i - 1], 0);
+    dl->n_unknown += dl->d[i - 1] < 0;
+    if ((j = i + (i & -i)) <= dl->n)
+      dl->tree[j] += dl->tree[i];
+  }
+}
+
+static void durlist_clear(durlist *dl) {
+  dl->n = dl->n_unknown = 0;
+  dl->total = 0;
+}
+
+static void count_song_event(songstats *st, char *what, time_t t) {
+  if (strcmp(what, "LOAD") == 0)
+    st->last = t;
+  else if (strcmp(what, "EOF") == 0)
+    st->plays++;
+  else if (strcmp(what, "SKIP") == 0)
+    st->skips++;
+}
+
+/* how often songs got played and skipped, from ~/.mpvq_history and from
+ * what's been played since */
+static void read_song_stats(void) {
+  char loc[PATH_MAX], buf[PATH_MAX + 64], what[8];
+  long long t;
+  int n;
+  songstats *st;
+  FILE *fp;
+
+  snprintf(loc, PATH_MAX, "%s/.mpvq_history", getenv("HOME"));
+  if ((fp = fopen(loc, "r")) == NULL)
+    return;
+
+  while (fgets(buf, sizeof(buf), fp)) {
+    buf[strcspn(buf, "\n")] = 0;
+    if (sscanf(buf, "%lld %7s %n", &t, what, &n) != 2)
+      continue;
+    if ((st = hget(&song_stats, buf + n)) == NULL) {
+      st = calloc(1, sizeof(songstats));
+      hput(&song_stats, buf + n, st);
+    }
+    count_song_event(st, what, t);
+  }
+
+  fclose(fp);
+}
+
+static double song_weight(songstats *st, time_t now) {
+  double days = WEIGHT_MAX_AGE;
+
+  if (st && st->last)
+    days = fmin((now - st->last) / 86400.0, WEIGHT_MAX_AGE);
+
+  return pow(1 + (st ? st->plays : 0), -weight_plays)
+    * pow(1 + (st ? st->skips : 0), -weight_skips)
+    * pow(1 + fmax(days, 0), weight_age);
+}
+
+/* songs the weighted random play won't pick, out of the last ones loaded */
+static int recent_span(void) {
+  int n = playlist.n_elems / 2;
+
+  n = n < RECENT_MAX ? n : RECENT_MAX;
+  return n < n_recent ? n : n_recent;
+}
+
+static int is_recent(char *path) {
+  uint64_t h = fnv1a(path, strlen(path));
+  int i, n = recent_span();
+
+  for (i = 1; i <= n; ++i)
+    if (recent[(recent_pos - i + RECENT_MAX) % RECENT_MAX] == h)
+      return 1;
+  return 0;
+}
+
+/* weight of <path> as of weights_at, cached in its stats */
+static double entry_weight(char *path) {
+  songstats *st = hget(&song_stats, path);
+
+  if (st == NULL)
+    return unknown_weight;
+  if (st->weight_at != weights_at) {
+    st->weight = song_weight(st, weights_at);
+    st->weight_at = weights_at;
+  }
+  return st->weight;
+}
+
+/* shuffle_w only covers the entries picks were made from so far. the ones
+ * added since get their weights here, and every WEIGHT_REFRESH all of them
+ * get recomputed with the ages as of now */
+static void sync_weights(void) {
+  time_t now = time(NULL);
+  int i;
+
+  if (!stats_read) {
+    read_song_stats();
+    stats_read = 1;
+  }
+  if (now - weights_at >= WEIGHT_REFRESH) {
+    weights_at = now;
+    unknown_weight = song_weight(NULL, now);
+    for (i = 0; i < shuffle_w.n; ++i)
+      shuffle_w.d[i] = entry_weight(playlist.elems[i]);
+    durlist_rebuild(&shuffle_w);
+  }
+  while (shuffle_w.n < playlist.n_elems)
+    durlist_push(&shuffle_w, entry_weight(playlist.elems[shuffle_w.n]));
+}
+
+/* writes <what> happened to <path> to the history, and counts it for the
+ * weighted random play. <path> is the song playing, and playlist_mtx is
+ * held */
+static void song_event(char *what, char *path) {
+  songstats *st;
+
+  histwrite("%s %s", what, path);
+
+  if (stats_read) {
+    if ((st = hget(&song_stats, path)) == NULL) {
+      st = calloc(1, sizeof(songstats));
+      hput(&song_stats, path, st);
+    }
+    count_song_event(st, what, time(NULL));
+    st->weight_at = 0;
+    if (current_playing < shuffle_w.n
+        && playlist.elems[current_playing] == path)
+      durlist_set(&shuffle_w, current_playing, entry_weight(path));
+  }
+  if (strcmp(what, "LOAD") == 0) {
+    recent[recent_pos] = fnv1a(path, strlen(path));
+    recent_pos = (recent_pos + 1) % RECENT_MAX;
+    n_recent += n_recent < RECENT_MAX;
+
+    free(back[back_pos]);
+    back[back_pos] = strdup(path);
+    back_pos = (back_pos + 1) % RECENT_MAX;
+    n_back += n_back < RECENT_MAX;
+  }
+}
+
+/* last path off the back ring, NULL if there's none. it's freed once
+ * another song gets loaded */
+static char *back_pop(void) {
+  if (n_back == 0)
+    return NULL;
+  n_back--;
+  back_pos = (back_pos - 1 + RECENT_MAX) % RECENT_MAX;
+  return back[back_pos];
+}
+
+/* next song for the weighted random play, -1 if there's nothing to play.
+ * a walk down the fenwick tree of the weights, so a pick is O(log n), and
+ * so is keeping it up to date with the playlist. playlist_mtx has to be
+ * held */
+static int shuffle_pick(void) {
+  double total;
+  int i = 0, tries;
+
+  if (playlist.n_elems == 0)
+    return -1;
+
+  sync_weights();
+  total = durlist_prefix(&shuffle_w, shuffle_w.n);
+  for (tries = 0; tries < SHUFFLE_TRIES; ++tries) {
+    i = durlist_find(&shuffle_w, total
+        * ((unsigned)RAND_FUNCTION() % (1 << 24)) / (1 << 24));
+    if (!is_recent(playlist.elems[i]) && !is_missing(playlist.elems[i]))
+      break;
+  }
+
+  /* unlucky, or most of the playlist is missing */
+  if (tries == SHUFFLE_TRIES)
+    i = next_playable(i, 1) >= 0 ? next_playable(i, 1) : next_playable(i, -1);
+
+  return i;
+}
+
+/* the song after the current one, in whichever order songs are played.
+ * playlist_mtx has to be held */
+static int next_song(void) {
+  int i = next_pick;
+
+  if (!wflag)
+    return next_playable(current_playing + 1, 1);
+
+  next_pick = -1;
+  if (i >= 0 && i < playlist.n_elems && !is_recent(playlist.elems[i])
+      && !is_missing(playlist.elems[i]))
+    return i;
+  return shuffle_pick();
+}
+
+/* the song before the current one: by index, or when playing weighted, the
+ * one loaded before it. playlist_mtx has to be held, and the playlist has to
+ * be tracked, see track_pending() */
+static int prev_song(void) {
+  char *path;
+  intptr_t i;
+
+  if (!wflag)
+    return next_playable(current_playing - 1, -1);
+
+  if (n_back && current_playing < playlist.n_elems
+      && strcmp(back[(back_pos - 1 + RECENT_MAX) % RECENT_MAX],
+        playlist.elems[current_playing]) == 0)
+    back_pop();
+  while ((path = back_pop()) != NULL)
+    if ((i = (intptr_t)hget(&playlist_index, path))
+        && !is_missing(playlist.elems[i - 1]))
+      return i - 1;
+
+  return -1;
+}
+
+/* the event thread calls this with playlist_mtx held, so the ui has to as
+ * well whenever <path> is a playlist entry */
+static void play_song(char *path) {
+  const char *command_load[] = { "loadfile", path, NULL },
+             *command_play[] = { "set", "pause", "no", NULL };
+
+  if (path) {
+    if (prefetch_count)
+      switch (is_cached(path)) {
+        case 1: COUNT(n_warm_starts); break;
+        case 0: COUNT(n_cold_starts); break;
+      }
+    apply_gain(path);
+    mpv_cmd(command_load);
+    song_event("LOAD", path);
+    if (wflag)
+      next_pick = shuffle_pick();
+    prefetch_kick();
+  } else
+    mpv_cmd(command_play);
+}
+
+static void pause_song() {
+  const char *command[] = { "set", "pause", "yes", NULL };
+
+  mpv_cmd(command);
+}
+
+/* plays the <i>th playlist entry. ui thread */
+static void play_entry(int i) {
+  pthread_mutex_lock(&playlist_mtx);
+  current_playing = i;
+  play_song(playlist.elems[i]);
+  pthread_mutex_unlock(&playlist_mtx);
+}
+
+static void *event_waiter(void *_) {
+  mpv_event *ev;
+  mpv_event_property *prop;
+  double pos;
+  int reason, next, failures = 0;
+  (void)_;
+  while (1) {
+    ev = mpv_wait_event(ctx, 1000);
+    switch (ev->event_id) {
+      case MPV_EVENT_END_FILE:
+        reason = ((mpv_event_end_file*)ev->data)->reason;
+        if (reason == MPV_END_FILE_REASON_ERROR)
+          COUNT(n_failed);
+
+        /* this took a while */
+        if (reason != MPV_END_FILE_REASON_EOF
+            && reason != MPV_END_FILE_REASON_ERROR)
+          break;
+
+        pthread_mutex_lock(&playlist_mtx);
+        if (pstate == state_nothing_playing) { /* the playlist got cleared */
+          pthread_mutex_unlock(&playlist_mtx);
+          break;
+        }
+        if (reason == MPV_END_FILE_REASON_EOF) {
+          COUNT(n_played);
+          failures = 0;
+          if (current_playing < playlist.n_elems)
+            song_event("EOF", playlist.elems[current_playing]);
+        } else if (current_playing < playlist.n_elems) {
+          /* a song that couldn't be played is skipped from now on, same
+           * as missing ones */
+          pthread_mutex_lock(&missing_mtx);
+          hput(&missing, playlist.elems[current_playing], MISSING_FAILED);
+          pthread_mutex_unlock(&missing_mtx);
+        }
+        /* e.g. only urls, while offline */
+        if (reason == MPV_END_FILE_REASON_ERROR
+            && ++failures >= MAX_FAILURES) {
+          failures = 0;
+          pstate = state_nothing_playing;
+        } else if ((next = next_song()) >= 0) {
+          current_playing = next;
+          play_song(playlist.elems[current_playing]);
+        } else {
+          pstate = state_nothing_playing;
+          current_playing = 0;
+        }
+        pthread_mutex_unlock(&playlist_mtx);
+        break;
+      case MPV_EVENT_FILE_LOADED:
+        if (resume_pos > 0) { /* restored session */
+          char pos[32];
+          const char *command[] = { "seek", pos, "absolute", NULL };
+
+          snprintf(pos, sizeof(pos), "%f", resume_pos);
+          resume_pos = 0;
+          mpv_cmd(command);
+        }
+        break;
+      case MPV_EVENT_PROPERTY_CHANGE:
+        prop = ev->data;
+        if (strcmp(prop->name, "time-pos") == 0) {
+          pos = prop->format == MPV_FORMAT_DOUBLE ? *(double*)prop->data : 0;
+          __atomic_store(&time_pos, &pos, __ATOMIC_RELAXED);
+        }
+        break;
+      default:
+        (void)0;
+        /* pass */
+    }
+  }
+
+  return NULL;
+}
+
+/* time_pos, which the event thread keeps updating */
+static double playing_pos(void) {
+  double pos;
+
+  __atomic_load(&time_pos, &pos, __ATOMIC_RELAXED);
+  return pos;
+}
+
+static pthread_t *init_mpv() {
+  int no = 0;
+  pthread_t *thr = malloc(sizeof(pthread_t));;
+
+  ctx = mpv_create();
+  if (!ctx)
+    errx(1, "mpv_create() failed");
+
+  mpv_set_option(ctx, "audio-display", MPV_FORMAT_FLAG, &no);
+  mpv_initialize(ctx);
+  mpv_observe_property(ctx, 0, "time-pos", MPV_FORMAT_DOUBLE);
+
+  pthread_create(thr, NULL, event_waiter, NULL);
+
+  return thr;
+}
+
+void swap(void **a, void **b) {
+  void *tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+/* https://github.com/krzysckh/shuf/blob/master/shuf.c */
+void shuf(void **a, int len) {
+  int i;
+
+  for (i = len - 1; i > 0; --i)
+    swap(&a[(unsigned)RAND_FUNCTION() % len], &a[i]);
+}
+
+/* less cursed implementation:
+ * https://rosettacode.org/wiki/Levenshtein_distance#C
+ */
+
+static int search_compar(const void *v1, const void *v2) {
+  char *o1 = strcasestr(*(char**)v1, search_buffer),
+       *o2 = strcasestr(*(char**)v2, search_buffer);
+
+  if (o1 && o2) return 0;
+  if (o1 && !o2) return -1;
+  if (!o1 && o2) return 1;
+
+  return -1 + (RAND_FUNCTION()) % 2;
+}
+
+/* i didn't like how strcoll() sorted my stuff :( */
+static int alphabetical(const void *v1, const void *v2) {
+  const char *s1 = *(char**)v1,
+             *s2 = *(char**)v2;
+
+  if (s1[0] == '.' && s1[1] == '.') return -1;
+  if (s2[0] == '.' && s2[1] == '.') return 1;
+  if (*s1 && *s2) {
+    if (tolower(*s1) > tolower(*s2))
+      return 1;
+    else if (tolower(*s1) < tolower(*s2))
+      return -1;
+    else {
+      ++s1, ++s2;
+      return alphabetical(&s1, &s2);
+    }
+  } else {
+    if (!*s1 && !*s2)
+      return 0;
+    if (!*s1)
+      return -1;
+    return 1;
+  }
+}
+
+static char *getext(char *path) {
+  char *p = strrchr(path, '.');
+  return p ? ++p : p;
+}
+
+static int is_music_ext(char *path) {
+  char *ext = getext(path);
+  int i;
+
+  if (ext) /* getext returns NULL when file has no extension */
+    for (i = 0; i < n_music_file_extensions; ++i)
+      if (strcmp(music_file_extensions[i], ext) == 0)
+        return 1;
+  return 0;
+}
+
+static int is_dir(char *path) {
+  struct stat s;
+  stat(path, &s);
+  return S_ISDIR(s.st_mode);
+}
+
+static int is_fifo(char *path) {
+  struct stat s;
+  return stat(path, &s) == 0 && S_ISFIFO(s.st_mode);
+}
+
+/* paths are only read from a stdin something writes into. a terminal,
+ * /dev/null (as under a service manager) or a redirected file isn't one */
+static int stdin_is_pipe(void) {
+  struct stat s;
+  return fstat(STDIN_FILENO, &s) == 0
+    && (S_ISFIFO(s.st_mode) || S_ISSOCK(s.st_mode));
+}
+
+// fancy, no clue why
+static int is_directory(char *path) {
+  char full[PATH_MAX];
+  snprintf(full, PATH_MAX, "%s%s/", cwd, path);
+
+  return is_dir(full);
+}
+
+static uint32_t be32(unsigned char *b) {
+  return (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8 | b[3];
+}
+
+static uint32_t le32(unsigned char *b) {
+  return (uint32_t)b[3] << 24 | b[2] << 16 | b[1] << 8 | b[0];
+}
+
+static uint64_t le64(unsigned char *b) {
+  return (uint64_t)le32(b + 4) << 32 | le32(b);
+}
+
+/* offset of the first byte after an id3v2 tag at the start of the file */
+static off_t skip_id3v2(int fd) {
+  unsigned char b[10];
+
+  if (pread(fd, b, 10, 0) != 10 || memcmp(b, "ID3", 3) != 0)
+    return 0;
+
+  /* syncsafe ints, 7 bits per byte. +10 for the footer, if there is one */
+  return 10 + (b[6] << 21 | b[7] << 14 | b[8] << 7 | b[9])
+    + (b[5] & 0x10 ? 10 : 0);
+}
+
+/* STREAMINFO is required to be the first metadata block */
+static double probe_flac(int fd) {
+  unsigned char b[42];
+  off_t off = skip_id3v2(fd);
+  uint64_t samples;
+  uint32_t rate;
+
+  if (pread(fd, b, 42, off) != 42 || memcmp(b, "fLaC", 4) != 0
+      || (b[4] & 0x7f) != 0)
+    return -1;
+
+  rate = b[18] << 12 | b[19] << 4 | b[20] >> 4;
+  samples = (uint64_t)(b[21] & 0x0f) << 32 | be32(b + 22);
+
+  return rate && samples ? (double)samples / rate : -1;
+}
+
+static double probe_mp3(int fd, off_t size) {
+  static const short kbps[2][3][15] = {
+    { /* mpeg 1, layers I, II, III */
+      { 0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448 },
+      { 0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384 },
+      { 0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320 },
+    }, { /* mpeg 2 and 2.5 */
+      { 0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256 },
+      { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+      { 0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160 },
+    }
+  };
+  static const int rates[3] = { 44100, 48000, 32000 };
+  unsigned char b[4096], *h = NULL, *x;
+  off_t off = skip_id3v2(fd);
+  ssize_t n, i;
+  int version, layer, rate, bitrate, spf, side;
+  uint32_t frames = 0;
+
+  if ((n = pread(fd, b, sizeof(b), off)) < 64)
+    return -1;
+
+  /* first frame sync. the xing/vbri frame has to fit in the buffer too */
+  for (i = 0; i < n - 64 && !h; ++i)
+    if (b[i] == 0xff && (b[i + 1] & 0xe0) == 0xe0
+        && (b[i + 1] >> 3 & 3) != 1 && (b[i + 1] >> 1 & 3) != 0
+        && (b[i + 2] >> 4) != 0x0f && (b[i + 2] >> 2 & 3) != 3)
+      h = b + i;
+  if (!h)
+    return -1;
+
+  version = h[1] >> 3 & 3;      /* 3 = mpeg 1, 2 = mpeg 2, 0 = mpeg 2.5 */
+  layer = 3 - (h[1] >> 1 & 3);  /* 0 = layer I, ... */
+  rate = rates[h[2] >> 2 & 3] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+  bitrate = kbps[version != 3][layer][h[2] >> 4];
+  spf = layer == 0 ? 384 : (layer == 1 || version == 3) ? 1152 : 576;
+
+  /* xing (or "Info" for cbr) header lives after the side info */
+  if (version == 3)
+    side = (h[3] >> 6) == 3 ? 17 : 32;
+  else
+    side = (h[3] >> 6) == 3 ? 9 : 17;
+  x = h + 4 + side;
+  if ((memcmp(x, "Xing", 4) == 0 || memcmp(x, "Info", 4) == 0)
+      && (be32(x + 4) & 1))
+    frames = be32(x + 8);
+  else if (memcmp(h + 36, "VBRI", 4) == 0)
+    frames = be32(h + 36 + 14);
+
+  if (frames)
+    return (double)frames * spf / rate;
+
+  /* no vbr header, so assume cbr and guess from the file size */
+  if (!bitrate)
+    return -1;
+  if (pread(fd, b, 3, size - 128) == 3 && memcmp(b, "TAG", 3) == 0)
+    size -= 128; /* id3v1 */
+  size -= off + (h - b);
+
+  return size * 8.0 / (bitrate * 1000.0);
+}
+
+/* granule position of the last page / sample rate from the first one */
+static double probe_ogg(int fd, off_t size) {
+  unsigned char b[65536], *p;
+  uint64_t granule, preskip = 0;
+  uint32_t rate;
+  ssize_t n, i;
+
+  if (pread(fd, b, 64, 0) != 64 || memcmp(b, "OggS", 4) != 0 || b[26] < 1)
+    return -1;
+
+  p = b + 27 + b[26]; /* first packet, after the segment table */
+  if (p + 19 > b + 64)
+    return -1;
+  if (memcmp(p, "\x01vorbis", 7) == 0)
+    rate = le32(p + 12);
+  else if (memcmp(p, "OpusHead", 8) == 0) {
+    rate = 48000; /* opus granules always count 48kHz samples */
+    preskip = p[10] | p[11] << 8;
+  } else
+    return -1;
+
+  /* the last page has to start within the last 64k (max page size) */
+  n = pread(fd, b, sizeof(b), size > (off_t)sizeof(b) ? size - (off_t)sizeof(b)
+      : 0);
+  for (i = n - 14; i >= 0; --i)
+    if (memcmp(b + i, "OggS", 4) == 0) {
+      granule = le64(b + i + 6);
+      if (granule == (uint64_t)-1 || !rate || granule < preskip)
+        return -1;
+      return (double)(granule - preskip) / rate;
+    }
+
+  return -1;
+}
+
+static double probe_wav(int fd) {
+  unsigned char b[8];
+  uint32_t byterate = 0, len;
+  off_t off = 12;
+
+  if (pread(fd, b, 4, 8) != 4 || memcmp(b, "WAVE", 4) != 0)
+    return -1;
+
+  while (pread(fd, b, 8, off) == 8) {
+    len = le32(b + 4);
+    if (memcmp(b, "fmt ", 4) == 0 && pread(fd, b, 4, off + 16) == 4)
+      byterate = le32(b);
+    else if (memcmp(b, "data", 4) == 0)
+      return byterate ? (double)len / byterate : -1;
+    off += 8 + len + (len & 1);
+  }
+
+  return -1;
+}
+
+/* for everything the header probes can't handle */
+static double probe_mpv(char *path) {
+  const char *command[] = { "loadfile", path, NULL };
+  double secs = -1;
+  int no = 0, done = 0;
+  mpv_handle *h;
+  mpv_event *ev;
+
+  if ((h = mpv_create()) == NULL)
+    return -1;
+
+  mpv_set_option_string(h, "ao", "null");
+  mpv_set_option_string(h, "vid", "no");
+  mpv_set_option_string(h, "pause", "yes");
+  mpv_set_option(h, "audio-display", MPV_FORMAT_FLAG, &no);
+  if (mpv_initialize(h) < 0)
+    goto end;
+
+  mpv_command(h, command);
+  while (!done) {
+    ev = mpv_wait_event(h, -1);
+    switch (ev->event_id) {
+      case MPV_EVENT_FILE_LOADED:
+        if (mpv_get_property(h, "duration", MPV_FORMAT_DOUBLE, &secs) < 0)
+          secs = -1;
+        done = 1;
+        break;
+      case MPV_EVENT_END_FILE:
+      case MPV_EVENT_SHUTDOWN:
+        done = 1;
+        break;
+      default:
+        (void)0;
+        /* pass */
+    }
+  }
+
+end:
+  mpv_terminate_destroy(h);
+  return secs;
+}
+
+static void duration_cache_path(char *loc) {
+  snprintf(loc, PATH_MAX, "%s/.mpvq_durations", getenv("HOME"));
+}
+
+static void duration_put(char *path, long long size, long long mtime,
+    double secs) {
+  duration *d = malloc(sizeof(duration));
+
+  d->size = size;
+  d->mtime = mtime;
+  d->secs = secs;
+  free(hput(&duration_cache, path, d));
+}
+
+static void write_duration_cache(void) {
+  char loc[PATH_MAX], tmp[PATH_MAX];
+  duration *d;
+  hent *e;
+  size_t i;
+  FILE *fp;
+
+  duration_cache_path(loc);
+  snprintf(tmp, PATH_MAX, "%s.tmp", loc);
+  if ((fp = fopen(tmp, "w")) == NULL)
+    return;
+
+  for (i = 0; i < duration_cache.n_b; ++i)
+    for (e = duration_cache.b[i]; e; e = e->next) {
+      d = e->val;
+      fprintf(fp, "%lld %lld %.3f %s\n", d->size, d->mtime, d->secs, e->key);
+    }
+
+  if (fclose(fp) == 0)
+    rename(tmp, loc);
+  else
+    unlink(tmp);
+}
+
+/* same format as the loudness cache: <size> <mtime> <seconds> <path>, and
+ * compacted the same way */
+static void read_duration_cache(void) {
+  char loc[PATH_MAX], buf[PATH_MAX + 128];
+  long long size, mtime;
+  double secs;
+  size_t n_lines = 0;
+  int n;
+  FILE *fp;
+
+  duration_cache_path(loc);
+  fp = fopen(loc, "r");
+  if (!fp) return;
+
+  while (fgets(buf, sizeof(buf), fp)) {
+    buf[strcspn(buf, "\n")] = 0;
+    n_lines++;
+    if (sscanf(buf, "%lld %lld %lf %n", &size, &mtime, &secs, &n) == 3
+        && buf[n])
+      duration_put(buf + n, size, mtime, secs);
+  }
+
+  fclose(fp);
+
+  if (n_lines > 2 * duration_cache.n)
+    write_duration_cache();
+}
+
+/* must hold duration_mtx */
+static double cached_duration(char *path) {
+  duration *d = hget(&duration_cache, path);
+  return d ? d->secs : -1;
+}
+
+/* -1 for formats it can't be read from the headers of */
+static double probe_header(char *path, int fd, off_t size) {
+  char *ext = getext(path);
+
+  if (ext && strcasecmp(ext, "flac") == 0)
+    return probe_flac(fd);
+  else if (ext && strcasecmp(ext, "mp3") == 0)
+    return probe_mp3(fd, size);
+  else if (ext && (strcasecmp(ext, "ogg") == 0
+        || strcasecmp(ext, "opus") == 0))
+    return probe_ogg(fd, size);
+  else if (ext && strcasecmp(ext, "wav") == 0)
+    return probe_wav(fd);
+  return -1;
+}
+
+/* runs on a duration_q worker */
+static void probe_duration(void *arg) {
+  char *path = arg, loc[PATH_MAX];
+  double secs = -1;
+  struct stat st;
+  duration *d;
+  FILE *fp;
+  int fd, cached = 0;
+
+  if (stat(path, &st) == 0) {
+    pthread_mutex_lock(&duration_mtx);
+    d = hget(&duration_cache, path);
+    if (d && d->size == st.st_size && d->mtime == st.st_mtime) {
+      secs = d->secs;
+      cached = 1;
+    }
+    pthread_mutex_unlock(&duration_mtx);
+
+    if (!cached && (fd = open(path, O_RDONLY)) >= 0) {
+      secs = probe_header(path, fd, st.st_size);
+      close(fd);
+
+      if (secs < 0)
+        secs = probe_mpv(path);
+    }
+  }
+
+  pthread_mutex_lock(&duration_mtx);
+  if (!cached && secs >= 0) {
+    duration_put(path, st.st_size, st.st_mtime, secs);
+    duration_cache_path(loc);
+    if ((fp = fopen(loc, "a")) != NULL) {
+      fprintf(fp, "%lld %lld %.3f %s\n", (long long)st.st_size,
+          (long long)st.st_mtime, secs, path);
+      fclose(fp);
+    }
+  }
+  probes_done = realloc(probes_done, sizeof(probe_result) *
+      (n_probes_done + 1));
+  probes_done[n_probes_done].path = path;
+  probes_done[n_probes_done].secs = secs;
+  n_probes_done++;
+  pthread_mutex_unlock(&duration_mtx);
+}
+
+static void init_durations(void) {
+  read_duration_cache();
+  workq_init(&duration_q, 0, 0);
+}
+
+/* "1:02:03" or "2:03" */
+static void fmt_duration(char *buf, size_t len, double secs) {
+  long s = secs;
+
+  if (s >= 3600)
+    snprintf(buf, len, "%ld:%02ld:%02ld", s / 3600, s / 60 % 60, s % 60);
+  else
+    snprintf(buf, len, "%ld:%02ld", s / 60, s % 60);
+}
+
+/* [start, end) of the bytes that are actually audio, so a retagged copy of a
+ * song still hashes the same */
+static void audio_payload(int fd, char *path, off_t size, off_t *start,
+    off_t *end) {
+  unsigned char b[32];
+  char *ext = getext(path);
+  uint32_t len;
+  off_t off;
+
+  *start = 0;
+  *end = size;
+  if (!ext)
+    return;
+
+  if (strcasecmp(ext, "mp3") == 0) {
+    *start = skip_id3v2(fd);
+    if (pread(fd, b, 3, *end - 128) == 3 && memcmp(b, "TAG", 3) == 0)
+      *end -= 128;
+    /* apev2 footer. its size counts the footer, but not the header */
+    if (pread(fd, b, 32, *end - 32) == 32 && memcmp(b, "APETAGEX", 8) == 0)
+      *end -= le32(b + 12) + (b[23] & 0x80 ? 32 : 0);
+  } else if (strcasecmp(ext, "flac") == 0) {
+    off = skip_id3v2(fd) + 4;
+    while (pread(fd, b, 4, off) == 4) {
+      off += 4 + (b[1] << 16 | b[2] << 8 | b[3]);
+      if (b[0] & 0x80) /* last metadata block */
+        break;
+    }
+    *start = off;
+  } else if (strcasecmp(ext, "wav") == 0) {
+    off = 12;
+    while (pread(fd, b, 8, off) == 8) {
+      len = le32(b + 4);
+      if (memcmp(b, "data", 4) == 0) {
+        *start = off + 8;
+        *end = off + 8 + len;
+        break;
+      }
+      off += 8 + len + (len & 1);
+    }
+  }
+
+  if (*start > *end || *end > size) { /* broken tags, just hash everything */
+    *start = 0;
+    *end = size;
+  }
+}
+
+static uint64_t hash_mix(uint64_t h, uint64_t w) {
+  h ^= w * 0x9e3779b97f4a7c15ULL;
+  h = (h << 31 | h >> 33) * 0xc2b2ae3d27d4eb4fULL;
+  return h;
+}
+
+/* 8 bytes at a time. not cryptographic, it only has to tell apart files
+ * that are already known to be of the same size */
+static int hash_range(int fd, off_t start, off_t end, uint64_t *out) {
+  static const size_t bufsz = 1 << 18;
+  unsigned char *buf = malloc(bufsz);
+  uint64_t h = 0x27d4eb2f165667c5ULL ^ (uint64_t)(end - start), w;
+  ssize_t n, i;
+  off_t off;
+
+  for (off = start; off < end; off += n) {
+    n = pread(fd, buf, (size_t)(end - off) < bufsz ? (size_t)(end - off) : bufsz,
+        off);
+    if (n <= 0) {
+      free(buf);
+      return -1;
+    }
+
+    for (i = 0; i + 8 <= n; i += 8) {
+      memcpy(&w, buf + i, 8);
+      h = hash_mix(h, w);
+    }
+    if (i < n) { /* only ever happens on the last read */
+      w = 0;
+      memcpy(&w, buf + i, n - i);
+      h = hash_mix(h, w);
+    }
+  }
+
+  free(buf);
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  *out = h ^ (h >> 32);
+  return 0;
+}
+
+static void hash_cache_path(char *loc) {
+  snprintf(loc, PATH_MAX, "%s/.mpvq_hashes", getenv("HOME"));
+}
+
+static void hash_put(char *key, uint64_t hash) {
+  uint64_t *v = malloc(sizeof(uint64_t));
+
+  *v = hash;
+  free(hput(&hash_cache, key, v));
+}
+
+/* one "<dev> <ino> <mtime> <hash>" per line, later lines win */
+static void read_hash_cache(void) {
+  char loc[PATH_MAX], buf[256];
+  unsigned long long hash;
+  int n;
+  FILE *fp;
+
+  hash_cache_path(loc);
+  fp = fopen(loc, "r");
+  if (!fp) return;
+
+  while (fgets(buf, sizeof(buf), fp))
+    if (sscanf(buf, "%*lld %*lld %*lld%n %llx", &n, &hash) == 1) {
+      buf[n] = 0;
+      hash_put(buf, hash);
+    }
+
+  fclose(fp);
+}
+
+static void init_hashes(void) {
+  read_hash_cache();
+  workq_init(&hash_q, 0, 1);
+}
+
+/* content hash of <path>, cached by inode and mtime. -1 if it can't be read */
+static int file_hash(char *path, long long dev, long long ino,
+    long long mtime, uint64_t *out) {
+  char key[96], loc[PATH_MAX];
+  uint64_t *cached;
+  off_t start, end;
+  struct stat st;
+  FILE *fp;
+  int fd, rv;
+
+  pthread_once(&hash_once, init_hashes);
+  snprintf(key, sizeof(key), "%lld %lld %lld", dev, ino, mtime);
+
+  pthread_mutex_lock(&hash_mtx);
+  cached = hget(&hash_cache, key);
+  if (cached)
+    *out = *cached;
+  pthread_mutex_unlock(&hash_mtx);
+  if (cached)
+    return 0;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  fstat(fd, &st);
+  audio_payload(fd, path, st.st_size, &start, &end);
+  rv = hash_range(fd, start, end, out);
+  close(fd);
+  if (rv < 0)
+    return -1;
+
+  pthread_mutex_lock(&hash_mtx);
+  hash_put(key, *out);
+  hash_cache_path(loc);
+  if ((fp = fopen(loc, "a")) != NULL) {
+    fprintf(fp, "%s %016llx\n", key, (unsigned long long)*out);
+    fclose(fp);
+  }
+  pthread_mutex_unlock(&hash_mtx);
+
+  return 0;
+}
+
+/* length of the audio payload of <path>. -1 if it can't be read */
+static int audio_length(char *path, long long *len, struct stat *st) {
+  off_t start, end;
+  int fd;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return -1;
+  if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode)) {
+    close(fd);
+    return -1;
+  }
+  audio_payload(fd, path, st->st_size, &start, &end);
+  close(fd);
+
+  *len = end - start;
+  return 0;
+}
+
+/* runs on a hash_q worker */
+static void hash_dupfile(void *arg) {
+  dupfile *f = arg;
+  f->hashed = file_hash(f->path, f->dev, f->ino, f->mtime, &f->hash) == 0;
+}
+
+static int dupfile_compar(const void *v1, const void *v2) {
+  const dupfile *a = *(dupfile**)v1, *b = *(dupfile**)v2;
+
+  if (a->len != b->len)
+    return a->len < b->len ? -1 : 1;
+  if (a->hash != b->hash)
+    return a->hash < b->hash ? -1 : 1;
+  return strcmp(a->path, b->path);
+}
+
+static void dup_add_file(dupfile ***files, int *n, int *cap, char *path) {
+  struct stat st;
+  long long len;
+  dupfile *f;
+
+  if (audio_length(path, &len, &st) < 0)
+    return;
+
+  if (*n >= *cap) {
+    *cap = *cap ? *cap * 2 : 1024;
+    *files = realloc(*files, sizeof(dupfile*) * *cap);
+  }
+
+  f = calloc(1, sizeof(dupfile));
+  f->path = strdup(path);
+  f->len = len;
+  f->dev = st.st_dev;
+  f->ino = st.st_ino;
+  f->mtime = st.st_mtime;
+  (*files)[(*n)++] = f;
+}
+
+/* <arg> is a NULL terminated list of strings: a directory that gets walked
+ * recursively, followed by the playlist at the time of starting the scan.
+ * groups of songs with the same audio in them are written to
+ * ~/.mpvq_duplicates. files are hashed (in parallel) only if another one has
+ * as much audio in it. tags don't count, so retagged copies still match */
+static void *find_duplicates(void *arg) {
+  char **args = arg, **dirs = NULL, *dir, path[PATH_MAX], loc[PATH_MAX];
+  int n_dirs = 0, cap_dirs = 1, n = 0, cap = 0, i, j, n_groups = 0,
+      n_dups = 0, fp_errno = 0;
+  dupfile **files = NULL;
+  struct dirent *de;
+  uint64_t start = now_ns();
+  DIR *dp;
+  FILE *fp;
+
+  pthread_once(&hash_once, init_hashes);
+
+  for (i = 1; args[i]; ++i) {
+    dup_add_file(&files, &n, &cap, args[i]);
+    free(args[i]);
+  }
+
+  dirs = malloc(sizeof(char*));
+  dirs[n_dirs++] = args[0];
+  free(args);
+  while (n_dirs > 0) {
+    dir = dirs[--n_dirs];
+    if ((dp = opendir(dir)) != NULL) {
+      while ((de = readdir(dp)) != NULL) {
+        if (de->d_name[0] == '.')
+          continue;
+        snprintf(path, PATH_MAX, "%s/%s", dir, de->d_name);
+        if (de->d_type == DT_DIR || (de->d_type == DT_UNKNOWN && is_dir(path))) {
+          if (n_dirs >= cap_dirs) {
+            cap_dirs *= 2;
+            dirs = realloc(dirs, sizeof(char*) * cap_dirs);
+          }
+          dirs[n_dirs++] = strdup(path);
+        } else if (is_music_ext(de->d_name))
+          dup_add_file(&files, &n, &cap, path);
+      }
+      closedir(dp);
+    }
+    free(dir);
+  }
+  free(dirs);
+
+  /* only songs that share an audio length with another one can be
+   * duplicates */
+  qsort(files, n, sizeof(dupfile*), dupfile_compar);
+  for (i = 0; i < n; i = j) {
+    for (j = i + 1; j < n && files[j]->len == files[i]->len; ++j)
+      ;
+    if (j - i > 1)
+      for (; i < j; ++i)
+        workq_push(&hash_q, hash_dupfile, files[i]);
+  }
+  workq_wait(&hash_q);
+
+  qsort(files, n, sizeof(dupfile*), dupfile_compar);
+  snprintf(loc, PATH_MAX, "%s/.mpvq_duplicates", getenv("HOME"));
+  if ((fp = fopen(loc, "w")) == NULL)
+    fp_errno = errno;
+  for (i = 0; fp && i < n; i = j) {
+    for (j = i + 1; j < n && files[j]->hashed && files[i]->hashed
+        && files[j]->len == files[i]->len
+        && files[j]->hash == files[i]->hash; ++j)
+      ;
+    if (j - i < 2)
+      continue;
+
+    n_groups++;
+    n_dups += j - i - 1;
+    for (; i < j; ++i)
+      fprintf(fp, "%s\n", files[i]->path);
+    fputc('\n', fp);
+  }
+  if (fp)
+    fclose(fp);
+
+  for (i = 0; i < n; ++i) {
+    free(files[i]->path);
+    free(files[i]);
+  }
+  free(files);
+
+  pthread_mutex_lock(&hash_mtx);
+  if (fp)
+    snprintf(dup_report, sizeof(dup_report), "%d duplicate groups (%d "
+        "redundant files) found. the groups were written to %s", n_groups,
+        n_dups, loc);
+  else
+    snprintf(dup_report, sizeof(dup_report), "cannot write %s: %s", loc,
+        strerror(fp_errno));
+  dup_report_ready = 1;
+  dup_scan_running = 0;
+  pthread_mutex_unlock(&hash_mtx);
+
+  hist_observe(&dup_scan_hist, now_ns() - start);
+
+  return NULL;
+}
+
+static void start_find_duplicates(char *dir) {
+  pthread_t thr;
+  char **args;
+  int running, i;
+
+  pthread_mutex_lock(&hash_mtx);
+  running = dup_scan_running;
+  dup_scan_running = 1;
+  pthread_mutex_unlock(&hash_mtx);
+
+  if (running)
+    return;
+
+  /* the playlist gets copied, so the scan doesn't race with edits to it */
+  args = malloc(sizeof(char*) * (playlist.n_elems + 2));
+  args[0] = strdup(dir);
+  for (i = 0; i < playlist.n_elems; ++i)
+    args[i + 1] = strdup(playlist.elems[i]);
+  args[i + 1] = NULL;
+
+  pthread_create(&thr, NULL, find_duplicates, args);
+  pthread_detach(thr);
+}
+
+/* hashes the audio of <path> into dup_hashes, as "<len> <hash>". 1 if a song
+ * with the same audio was in there already */
+static int dup_hash(char *path, long long len) {
+  char key[64];
+  uint64_t hash;
+  struct stat st;
+
+  if (stat(path, &st) < 0
+      || file_hash(path, st.st_dev, st.st_ino, st.st_mtime, &hash) < 0)
+    return 0;
+
+  snprintf(key, sizeof(key), "%lld %016llx", len, (unsigned long long)hash);
+  if (hget(&dup_hashes, key))
+    return 1;
+  hput(&dup_hashes, key, (void*)1);
+  return 0;
+}
+
+/* remembers <path>, 1 if it's a duplicate of a song remembered before. files
+ * only get hashed once another one has as much audio in them, so most songs
+ * cost an open() and reading their tags. dedup_q worker only */
+static int dedup_remember(char *path) {
+  char key[32];
+  long long len;
+  struct stat st;
+  dupfirst *f;
+
+  if (hget(&dup_paths, path))
+    return 1;
+  hput(&dup_paths, path, (void*)1);
+  if (audio_length(path, &len, &st) < 0)
+    return 0;
+
+  snprintf(key, sizeof(key), "%lld", len);
+  if ((f = hget(&dup_lengths, key)) == NULL) {
+    f = malloc(sizeof(dupfirst) + strlen(path) + 1);
+    f->hashed = 0;
+    strcpy(f->path, path);
+    hput(&dup_lengths, key, f);
+    return 0;
+  }
+
+  if (!f->hashed) {
+    dup_hash(f->path, len);
+    f->hashed = 1;
+  }
+  return dup_hash(path, len);
+}
+
+/* runs on the dedup_q worker. songs that pass the check go to the ui */
+static void dedup_job(void *arg) {
+  dedupjob *j = arg;
+
+  pthread_once(&hash_once, init_hashes);
+  switch (j->kind) {
+    case dedup_reset:
+      hclear(&dup_paths, 0);
+      hclear(&dup_lengths, 1);
+      hclear(&dup_hashes, 0);
+      break;
+    case dedup_register:
+      dedup_remember(j->path);
+      break;
+    case dedup_check:
+      if (!dedup_remember(j->path)) {
+        pthread_mutex_lock(&dedup_mtx);
+        if (n_dedup_done >= dedup_done_cap) {
+          dedup_done_cap = dedup_done_cap ? dedup_done_cap * 2 : 256;
+          dedup_done = realloc(dedup_done, sizeof(dedupjob*) * dedup_done_cap);
+        }
+        dedup_done[n_dedup_done++] = j;
+        pthread_mutex_unlock(&dedup_mtx);
+        return;
+      }
+      __atomic_sub_fetch(&n_dedup_pending, 1, __ATOMIC_RELAXED);
+      break;
+  }
+
+  free(j->path);
+  free(j);
+}
+
+static void dedup_push(int kind, char *path) {
+  dedupjob *j = malloc(sizeof(dedupjob));
+
+  j->kind = kind;
+  j->path = path ? strdup(path) : NULL;
+  j->gen = dedup_gen;
+  if (kind == dedup_check)
+    __atomic_add_fetch(&n_dedup_pending, 1, __ATOMIC_RELAXED);
+  workq_push(&dedup_q, dedup_job, j);
+}
+
+static void init_dedup(void) {
+  workq_init(&dedup_q, 1, 1);
+}
+
+static uint64_t percentile(uint64_t *v, int n, double p) {
+  return n ? v[(int)(p * (n - 1))] : 0;
+}
+
+static int u64_compar(const void *v1, const void *v2) {
+  uint64_t a = *(uint64_t*)v1, b = *(uint64_t*)v2;
+  return (a > b) - (a < b);
+}
+
+static void print_latencies(char *what, uint64_t *v, int n) {
+  qsort(v, n, sizeof(uint64_t), u64_compar);
+  printf("%-9s p50 %8.1fus  p90 %8.1fus  p99 %8.1fus  max %8.1fus\n", what,
+      percentile(v, n, .5) / 1e3, percentile(v, n, .9) / 1e3,
+      percentile(v, n, .99) / 1e3, n ? v[n - 1] / 1e3 : 0);
+}
+
+/* waits until nothing more gets written to the headless terminal */
+static uint64_t pty_settle(void) {
+  uint64_t n;
+
+  do {
+    n = LOAD(pty_bytes);
+    usleep(20000);
+  } while (n != LOAD(pty_bytes));
+
+  return n;
+}
+
+static void replay_report(void) {
+  uint64_t bytes;
+  int frames = n_lat;
+
+  tb_deinit();
+  bytes = pty_settle();
+
+  /* events that came in while a frame was drawn get handled together, the
+   * latencies are of all of a frame's */
+  printf("replayed %d events from %s in %d frames, latencies are per frame\n",
+      n_replay_evs, replay_path, frames);
+  print_latencies("handling", handle_lat, n_lat);
+  print_latencies("render", render_lat, n_lat);
+  printf("terminal  %llu bytes written, %.1f per frame\n",
+      (unsigned long long)bytes, frames ? (double)bytes / frames : 0);
+  exit(0);
+}
+
+/* gives the headless terminal the size of a recorded resize. termbox only
+ * looks at it again on SIGWINCH, and turns that into a resize event of its
+ * own, which replaces the recorded one */
+static void replay_resize(struct tb_event *ev) {
+  struct winsize ws = { 0 };
+  struct tb_event resized;
+
+  ws.ws_col = ev->w;
+  ws.ws_row = ev->h;
+  ioctl(pty_master, TIOCSWINSZ, &ws);
+  raise(SIGWINCH);
+  if (tb_peek_event(&resized, 1000) == TB_OK)
+    *ev = resized;
+}
+
+/* every event read by mpvq goes through here, so it can be recorded (-r) or
+ * come from a recording instead of the terminal (-R). when a replay runs out
+ * of events, the report gets printed and mpvq exits */
+static int poll_event(struct tb_event *ev, int timeout_ms) {
+  int rv;
+
+  if (replay_evs) {
+    if (replay_pos >= n_replay_evs && timeout_ms < 0)
+      replay_report();
+    /* hand out only what would be waiting by now if the user was typing
+     * since the last event, so input gets coalesced the same way */
+    if (replay_pos >= n_replay_evs || (timeout_ms >= 0 && replay_pos > 0
+          && replay_ts[replay_pos] - replay_ts[replay_pos - 1]
+          > (now_ns() - replay_last) / 1000 + timeout_ms * 1000ull))
+      return TB_ERR_NO_EVENT;
+    replay_last = now_ns();
+    *ev = replay_evs[replay_pos++];
+    if (ev->type == TB_EVENT_RESIZE)
+      replay_resize(ev);
+    return TB_OK;
+  }
+
+  rv = tb_peek_event(ev, timeout_ms);
+  if (rv == TB_OK && record_fp)
+    fprintf(record_fp, "%llu %d %d %d %lu %d %d %d %d\n",
+        (unsigned long long)(now_ns() - record_start) / 1000, ev->type,
+        ev->mod, ev->key, (unsigned long)ev->ch, ev->w, ev->h, ev->x, ev->y);
+
+  return rv;
+}
+
+static void start_recording(void) {
+  if ((record_fp = fopen(record_path, "w")) == NULL)
+    err(1, "cannot open %s", record_path);
+
+  setvbuf(record_fp, NULL, _IOLBF, 0);
+  fprintf(record_fp, REPLAY_HEADER " %d %d\n", tb_width(), tb_height());
+  record_start = now_ns();
+}
+
+/* reads a recording made with -r. returns the size of the terminal it was
+ * made in through <w> and <h> */
+static void read_recording(int *w, int *h) {
+  char buf[256];
+  unsigned long long t;
+  unsigned long ch;
+  int type, mod, key, cap = 0;
+  struct tb_event ev = { 0 };
+  FILE *fp;
+
+  if ((fp = fopen(replay_path, "r")) == NULL)
+    err(1, "cannot open %s", replay_path);
+  if (!fgets(buf, sizeof(buf), fp)
+      || sscanf(buf, REPLAY_HEADER " %d %d", w, h) != 2)
+    errx(1, "%s is not an mpvq recording", replay_path);
+
+  while (fgets(buf, sizeof(buf), fp)) {
+    if (sscanf(buf, "%llu %d %d %d %lu %d %d %d %d", &t, &type, &mod, &key,
+          &ch, &ev.w, &ev.h, &ev.x, &ev.y) != 9)
+      continue;
+    ev.type = type;
+    ev.mod = mod;
+    ev.key = key;
+    ev.ch = ch;
+
+    if (n_replay_evs >= cap) {
+      cap = cap ? cap * 2 : 256;
+      replay_evs = realloc(replay_evs, sizeof(struct tb_event) * cap);
+      replay_ts = realloc(replay_ts, sizeof(uint64_t) * cap);
+    }
+    replay_ts[n_replay_evs] = t;
+    replay_evs[n_replay_evs++] = ev;
+  }
+  fclose(fp);
+
+  handle_lat = malloc(sizeof(uint64_t) * (n_replay_evs + 1));
+  render_lat = malloc(sizeof(uint64_t) * (n_replay_evs + 1));
+}
+
+static void *pty_drainer(void *_) {
+  char buf[4096];
+  ssize_t n;
+  (void)_;
+
+  while ((n = read(pty_master, buf, sizeof(buf))) > 0)
+    __atomic_fetch_add(&pty_bytes, n, __ATOMIC_RELAXED);
+
+  return NULL;
+}
+
+/* termbox on a pseudo terminal nobody looks at, for -b and -R. whatever it
+ * writes is only counted */
+static void init_headless(int w, int h) {
+  struct winsize ws = { 0 };
+  pthread_t thr;
+  int slave;
+
+  if ((pty_master = posix_openpt(O_RDWR | O_NOCTTY)) < 0
+      || grantpt(pty_master) < 0 || unlockpt(pty_master) < 0
+      || (slave = open(ptsname(pty_master), O_RDWR | O_NOCTTY)) < 0)
+    err(1, "cannot open a pseudo terminal");
+
+  ws.ws_col = w;
+  ws.ws_row = h;
+  ioctl(pty_master, TIOCSWINSZ, &ws);
+  setenv("TERM", "xterm", 0);
+
+  pthread_create(&thr, NULL, pty_drainer, NULL);
+  pthread_detach(thr);
+
+  if (tb_init_fd(slave) != TB_OK)
+    errx(1, "cannot init termbox on %s", ptsname(pty_master));
+}
+
+static void draw_outline(char* title, int x1, int y1, int x2, int y2) {
+  const wchar_t *bs = aflag ? ascii_borderstr : utf8_borderstr,
         n = *bs++, e = *bs++, s = *bs++, w = *bs++, ne = *bs++, es = *bs++,
         sw = *bs++, nw = *bs++;
   int i;
 
-  tb_set_cell(x1, y1, nw, TB_DEFAULT, TB_DEFAULT);
-  tb_set_cell(x2, y1, ne, TB_DEFAULT, TB_DEFAULT);
-  tb_set_cell(x2, y2, es, TB_DEFAULT, TB_DEFAULT);
-  tb_set_cell(x1, y2, sw, TB_DEFAULT, TB_DEFAULT);
-  for (i = x1 + 1; i < x2; ++i) {
-    tb_set_cell(i, y1, n, TB_DEFAULT, TB_DEFAULT);
-    tb_set_cell(i, y2, s, TB_DEFAULT, TB_DEFAULT);
+  tb_set_cell(x1, y1, nw, TB_DEFAULT, TB_DEFAULT);
+  tb_set_cell(x2, y1, ne, TB_DEFAULT, TB_DEFAULT);
+  tb_set_cell(x2, y2, es, TB_DEFAULT, TB_DEFAULT);
+  tb_set_cell(x1, y2, sw, TB_DEFAULT, TB_DEFAULT);
+  for (i = x1 + 1; i < x2; ++i) {
+    tb_set_cell(i, y1, n, TB_DEFAULT, TB_DEFAULT);
+    tb_set_cell(i, y2, s, TB_DEFAULT, TB_DEFAULT);
+  }
+
+  for (i = y1 + 1; i < y2; ++i) {
+    tb_set_cell(x1, i, e, TB_DEFAULT, TB_DEFAULT);
+    tb_set_cell(x2, i, w, TB_DEFAULT, TB_DEFAULT);
+  }
+
+  tb_print(x1 + 3, y1, TB_BLUE, TB_DEFAULT, title);
+}
+
+static void handle_playpause(int change) {
+  if (change) {
+    if (pstate == state_playing) {
+      pstate = state_paused;
+      handle_playpause(0);
+    } else if (pstate == state_nothing_playing) {
+      pstate = state_playing;
+      play_entry(current_playing);
+    } else {
+      pstate = state_playing;
+      play_song(NULL);
+      handle_playpause(0);
+    }
+  }
+}
+
+static void draw_list(gui_list *l, int use_basename, int draw_cursor,
+    int draw_playing) {
+  int i,
+      maxlen = l->x2 - l->x1 - 1,
+      maxh = l->y2 - l->y1;
+  char *s;
+  uintattr_t bg, fg;
+
+  assert(l->x2 > l->x1);
+  assert(l->y2 > l->y1);
+
+  for (i = 0; i < (l->n_elems > maxh ? maxh : l->n_elems); ++i) {
+    bg = fg = 0;
+    /* basename() may write to its argument, and a restored session's
+     * entries are in a read only mapping */
+    s = arena_strdup(&frame, l->elems[i + l->scroll]);
+    if (use_basename)
+      s = basename(s);
+    if ((int)strlen(s) > maxlen)
+      strcpy(s + maxlen - 4, "...");
+
+    if (l->scroll + i == current_playing && draw_playing) {
+      if (pstate == state_playing)
+        fg = TB_GREEN;
+      else
+        fg = TB_RED;
+    } else if (draw_playing && is_missing(l->elems[i + l->scroll]))
+      fg = TB_YELLOW;
+    if (draw_cursor && l->scroll + i == l->cur) {
+      bg = TB_DEFAULT | TB_REVERSE;
+      if (!fg)
+        fg = TB_DEFAULT | TB_REVERSE;
+    } else {
+      bg = TB_DEFAULT;
+      if (!fg)
+        fg = TB_DEFAULT;
+    }
+
+    tb_print(l->x1, l->y1 + i, fg, bg, s);
+  }
+}
+
+/* appends a copy of <path> to a list */
+static char *list_push(gui_list *l, char *s) {
+  if (l->n_elems >= l->cap) {
+    l->cap = l->cap ? l->cap * 2 : 256;
+    l->elems = realloc(l->elems, sizeof(char*) * l->cap);
+  }
+
+  session_dirty = 1;
+  return l->elems[l->n_elems++] = arena_strdup(&l->strs, s);
+}
+
+/* throws away all elements, but keeps the memory for them */
+static void list_clear(gui_list *l) {
+  arena_reset(&l->strs);
+  l->n_elems = 0;
+  session_dirty = 1;
+}
+
+/* starts all the background work that's done per song, for the <i>th
+ * entry, which has to be the last one tracked so far */
+static void playlist_track(int i) {
+  char *path = playlist.elems[i];
+
+  hput(&playlist_index, path, (void*)(intptr_t)(i + 1));
+
+  durlist_push(&playlist_durs, -1);
+  workq_push(&duration_q, probe_duration, strdup(path));
+  if (dflag)
+    dedup_push(dedup_register, path);
+}
+
+/* entries restored from a session get tracked a bit at a time, so the first
+ * frame doesn't wait for all of them. everything that needs the index or
+ * the durations of the whole playlist calls this with a <budget_ns> of 0,
+ * which tracks all that's left */
+static void track_pending(uint64_t budget_ns) {
+  uint64_t start = budget_ns ? now_ns() : 0;
+
+  while (playlist_durs.n < playlist.n_elems) {
+    playlist_track(playlist_durs.n);
+    if (budget_ns && now_ns() - start >= budget_ns)
+      break;
+  }
+}
+
+/* appends a copy of <path> */
+static void playlist_push(char *apath) {
+  int i;
+
+  track_pending(0);
+  pthread_mutex_lock(&playlist_mtx);
+  list_push(&playlist, apath);
+  i = playlist.n_elems - 1;
+  /* e.g. streamed in while the songs before it play */
+  if (!wflag && pstate != state_nothing_playing && i > current_playing
+      && i <= current_playing + prefetch_count)
+    prefetch_kick();
+  pthread_mutex_unlock(&playlist_mtx);
+  playlist_track(i);
+}
+
+static void clear_playlist(void) {
+  const char *command_stop[] = { "stop", NULL };
+
+  pthread_mutex_lock(&playlist_mtx);
+  if (pstate != state_nothing_playing)
+    mpv_cmd(command_stop);
+  pstate = state_nothing_playing; /* see event_waiter() */
+  list_clear(&playlist);
+  current_playing = 0; /* the event thread mustn't index the old one */
+  durlist_clear(&shuffle_w);
+  next_pick = -1;
+  pthread_mutex_unlock(&playlist_mtx);
+  hclear(&playlist_index, 0);
+  if (dflag) { /* what's still being checked was meant for the old one */
+    dedup_gen++;
+    dedup_push(dedup_reset, NULL);
+  }
+  durlist_clear(&playlist_durs);
+  pthread_mutex_lock(&missing_mtx);
+  hclear(&missing, 0);
+  pthread_mutex_unlock(&missing_mtx);
+  loudness_fed = 0;
+}
+
+/* has to be called after playlist.elems got permuted, with playlist_mtx
+ * held */
+static void playlist_reordered(void) {
+  int i;
+
+  track_pending(0);
+  pthread_mutex_lock(&duration_mtx);
+  for (i = 0; i < playlist.n_elems; ++i) {
+    hput(&playlist_index, playlist.elems[i], (void*)(intptr_t)(i + 1));
+    playlist_durs.d[i] = cached_duration(playlist.elems[i]);
+  }
+  pthread_mutex_unlock(&duration_mtx);
+
+  durlist_rebuild(&playlist_durs);
+  for (i = 0; i < shuffle_w.n; ++i)
+    shuffle_w.d[i] = entry_weight(playlist.elems[i]);
+  durlist_rebuild(&shuffle_w);
+  if (wflag) /* what it pointed at moved */
+    next_pick = shuffle_pick();
+  loudness_fed = 0;
+  session_dirty = 1;
+  prefetch_kick();
+}
+
+/* swap of 2 neighbours, cheaper than playlist_reordered() */
+static void playlist_swap(int a, int b) {
+  int lo = a < b ? a : b, hi = a < b ? b : a;
+  double da;
+
+  track_pending(0);
+  da = playlist_durs.d[a];
+  swap((void**)&playlist.elems[a], (void**)&playlist.elems[b]);
+  hput(&playlist_index, playlist.elems[a], (void*)(intptr_t)(a + 1));
+  hput(&playlist_index, playlist.elems[b], (void*)(intptr_t)(b + 1));
+  durlist_set(&playlist_durs, a, playlist_durs.d[b]);
+  durlist_set(&playlist_durs, b, da);
+  if (loudness_fed > lo)
+    loudness_fed = lo;
+  if (hi < shuffle_w.n) {
+    da = shuffle_w.d[a];
+    durlist_set(&shuffle_w, a, shuffle_w.d[b]);
+    durlist_set(&shuffle_w, b, da);
+  } else if (lo < shuffle_w.n) /* the other one isn't weighted yet */
+    durlist_set(&shuffle_w, lo, entry_weight(playlist.elems[lo]));
+  if (next_pick == a || next_pick == b)
+    next_pick = next_pick == a ? b : a;
+  session_dirty = 1;
+}
+
+/* queue playlist entries up for loudness analysis as the queue drains, so it
+ * doesn't grow with the playlist. entries that moved before the ones looked
+ * at get looked at again; those already analyzed only cost a lookup */
+static void feed_loudness(void) {
+  int steps, done;
+  char *path;
+
+  for (steps = 0; steps < INGEST_MAX_JOBS && loudness_fed < playlist_durs.n
+      && workq_pending(&loudness_q) < LOUDNESS_QUEUE; ++steps) {
+    path = playlist.elems[loudness_fed++];
+    pthread_mutex_lock(&loudness_mtx);
+    done = hget(&loudness_cache, path) != NULL;
+    pthread_mutex_unlock(&loudness_mtx);
+    if (!done)
+      loudness_enqueue(path);
+  }
+}
+
+/* apply durations probed since the last call. ui thread only */
+static void collect_probes(void) {
+  probe_result *done;
+  intptr_t i;
+  int n, j;
+
+  pthread_mutex_lock(&duration_mtx);
+  done = probes_done;
+  n = n_probes_done;
+  probes_done = NULL;
+  n_probes_done = 0;
+  pthread_mutex_unlock(&duration_mtx);
+
+  for (j = 0; j < n; ++j) {
+    if ((i = (intptr_t)hget(&playlist_index, done[j].path)) != 0)
+      durlist_set(&playlist_durs, i - 1, done[j].secs);
+    free(done[j].path);
+  }
+  free(done);
+}
+
+/* <path> has to be resolved already. with -d it only gets added once the
+ * dedup_q worker is done with it, see collect_dedup() */
+static void playlist_add_file(char *path) {
+  track_pending(0);
+  /* check if song isn't already in the playlist */
+  if (hget(&playlist_index, path))
+    return;
+
+  if (dflag)
+    dedup_push(dedup_check, path);
+  else
+    playlist_push(path);
+}
+
+/* add the songs that turned out not to be duplicates. ui thread only */
+static void collect_dedup(void) {
+  dedupjob **done;
+  int n, i;
+
+  pthread_mutex_lock(&dedup_mtx);
+  done = dedup_done;
+  n = n_dedup_done;
+  dedup_done = NULL;
+  n_dedup_done = dedup_done_cap = 0;
+  pthread_mutex_unlock(&dedup_mtx);
+
+  for (i = 0; i < n; ++i) {
+    if (done[i]->gen == dedup_gen && !hget(&playlist_index, done[i]->path))
+      playlist_push(done[i]->path);
+    __atomic_sub_fetch(&n_dedup_pending, 1, __ATOMIC_RELAXED);
+    free(done[i]->path);
+    free(done[i]);
+  }
+  free(done);
+}
+
+#ifdef __linux__
+/* statx()es all <n> paths through one io_uring, so the kernel can wait on
+ * them in parallel instead of one stat() after another (which is what hurts
+ * on network mounts and spun down disks). sets gone[i] for the paths that
+ * can't be stat'd. returns 0 if io_uring can't be used (old kernel, seccomp)
+ * and the caller has to stat() them itself */
+static int statx_batch(char **paths, int n, char *gone) {
+  struct io_uring_params p;
+  struct io_uring_sqe *sqes, *sqe;
+  struct io_uring_cqe *cqes, *cqe;
+  struct statx *stx;
+  unsigned *sq_tail, *sq_array, *cq_head, *cq_tail, cq_mask, head;
+  size_t sq_len, cq_len, sqes_len;
+  char *sq, *cq = MAP_FAILED;
+  int fd, i, done = 0, ok = 0, r;
+
+  memset(&p, 0, sizeof(p));
+  if ((fd = syscall(__NR_io_uring_setup, n, &p)) < 0)
+    return 0;
+
+  sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+  sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      fd, IORING_OFF_SQ_RING);
+  sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || sqes == MAP_FAILED)
+    goto out;
+  if (p.features & IORING_FEAT_SINGLE_MMAP)
+    cq = sq;
+  else if ((cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING)) == MAP_FAILED)
+    goto out;
+
+  sq_tail = (unsigned *)(sq + p.sq_off.tail);
+  sq_array = (unsigned *)(sq + p.sq_off.array);
+  cq_head = (unsigned *)(cq + p.cq_off.head);
+  cq_tail = (unsigned *)(cq + p.cq_off.tail);
+  cq_mask = *(unsigned *)(cq + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+  /* the results aren't looked at, but the kernel needs somewhere to put
+   * them */
+  stx = malloc(n * sizeof(*stx));
+  for (i = 0; i < n; ++i) {
+    sqe = &sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_STATX;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t)paths[i];
+    sqe->len = STATX_TYPE;
+    sqe->off = (uintptr_t)&stx[i];
+    sqe->user_data = i;
+    sq_array[i] = i;
+    gone[i] = 0;
+  }
+  /* a fresh ring starts at 0 */
+  __atomic_store_n(sq_tail, n, __ATOMIC_RELEASE);
+
+  for (r = n; done < n; r = 0) {
+    if (syscall(__NR_io_uring_enter, fd, r, n - done,
+        IORING_ENTER_GETEVENTS, NULL, 0) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      cqe = &cqes[head++ & cq_mask];
+      /* kernels before 5.6 don't know IORING_OP_STATX */
+      if (cqe->res == -EINVAL)
+        goto unsupported;
+      gone[cqe->user_data] = cqe->res < 0;
+      done++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+  /* if io_uring_enter failed halfway the rest is taken as still there,
+   * it's checked again on the next pass */
+  ok = done > 0;
+unsupported:
+  free(stx);
+out:
+  if (cq != MAP_FAILED && cq != sq)
+    munmap(cq, cq_len);
+  if (sqes != MAP_FAILED)
+    munmap(sqes, sqes_len);
+  if (sq != MAP_FAILED)
+    munmap(sq, sq_len);
+  close(fd);
+  return ok;
+}
+#endif
+
+static void validate_batch(void *arg) {
+  vbatch *b = arg;
+  struct stat st;
+  char gone[VALIDATE_BATCH];
+  int i;
+
+#ifdef __linux__
+  if (!statx_batch(b->paths, b->n, gone))
+#endif
+    for (i = 0; i < b->n; ++i)
+      gone[i] = stat(b->paths[i], &st) != 0;
+
+  pthread_mutex_lock(&missing_mtx);
+  for (i = 0; i < b->n; ++i) {
+    if (gone[i])
+      hput(&missing, b->paths[i], MISSING_GONE);
+    else if (hget(&missing, b->paths[i]) == MISSING_GONE)
+      hdel(&missing, b->paths[i]);
+  }
+  pthread_mutex_unlock(&missing_mtx);
+
+  /* the last touch of the pass' memory, see validate_playlist() */
+  __atomic_sub_fetch(&n_validating, 1, __ATOMIC_RELEASE);
+}
+
+/* checks all the playlist entries for still being there, a batch of them
+ * per job. done after reading a playlist and every VALIDATE_INTERVAL
+ * seconds, so moved songs and unmounted disks get skipped instead of
+ * stopping playback. urls are left alone */
+static void validate_playlist(void) {
+  size_t len = 0, l;
+  char *p;
+  int i, n = 0, nb;
+
+  last_validate = time(NULL);
+  /* the paths are copied into one buffer, and the batches point into it.
+   * both are reused once the previous pass is done with them */
+  if (__atomic_load_n(&n_validating, __ATOMIC_ACQUIRE))
+    return;
+
+  for (i = 0; i < playlist.n_elems; ++i)
+    if (*playlist.elems[i] == '/') {
+      len += strlen(playlist.elems[i]) + 1;
+      n++;
+    }
+  if (n == 0)
+    return;
+
+  if (len > validate_cap) {
+    validate_cap = len * 2;
+    validate_buf = realloc(validate_buf, validate_cap);
+  }
+  nb = (n + VALIDATE_BATCH - 1) / VALIDATE_BATCH;
+  if (nb > vbatches_cap) {
+    vbatches_cap = nb * 2;
+    vbatches = realloc(vbatches, sizeof(vbatch) * vbatches_cap);
+  }
+
+  p = validate_buf;
+  for (i = 0, n = 0; i < playlist.n_elems; ++i) {
+    if (*playlist.elems[i] != '/')
+      continue;
+    l = strlen(playlist.elems[i]) + 1;
+    vbatches[n / VALIDATE_BATCH].paths[n % VALIDATE_BATCH] =
+      memcpy(p, playlist.elems[i], l);
+    vbatches[n / VALIDATE_BATCH].n = n % VALIDATE_BATCH + 1;
+    p += l;
+    n++;
+  }
+
+  __atomic_store_n(&n_validating, nb, __ATOMIC_RELAXED);
+  for (i = 0; i < nb; ++i)
+    workq_push(&validate_q, validate_batch, &vbatches[i]);
+}
+
+static void init_validation(void) {
+  workq_init(&validate_q, 0, 0);
+}
+
+static void playlist_add_song(char *apath) {
+  char path[PATH_MAX], songpath[PATH_MAX];
+  DIR *dp;
+  struct dirent *de;
+
+  snprintf(songpath, PATH_MAX, "%s%s", cwd, apath);
+  if (realpath(songpath, path) == NULL)
+    return;
+
+  if (is_directory(apath)) {
+    dp = opendir(path);
+
+    if (!dp) {
+      tb_deinit();
+      err(errno, "cannot opendir(%s)", path);
+    }
+
+    while ((de = readdir(dp)) != NULL) {
+      if (is_music_ext(de->d_name)) {
+        snprintf(songpath, PATH_MAX, "%s/%s", apath, de->d_name);
+        playlist_add_song(songpath);
+      }
+    }
+
+    closedir(dp);
+    return;
+  }
+
+  playlist_add_file(path);
+}
+
+/* reads paths, one per line (or NUL terminated with -0), from <arg> (a path,
+ * or NULL for stdin) and queues them up for the ui. blocks when the ui can't
+ * keep up, so the producer does instead of mpvq's memory growing. opening a
+ * fifo waits for a writer, which is why it's done here */
+static void *ingest_stream(void *arg) {
+  char *line = NULL, path[PATH_MAX];
+  size_t cap = 0;
+  ssize_t n;
+  FILE *fp = arg ? fopen(arg, "r") : stdin;
+
+  lower_thread_priority();
+  while (fp && (n = getdelim(&line, &cap, zflag ? '\0' : '\n', fp)) > 0) {
+    if (line[n - 1] == (zflag ? '\0' : '\n'))
+      line[n - 1] = 0;
+    if (!*line || realpath(line, path) == NULL || is_dir(path))
+      continue;
+
+    pthread_mutex_lock(&ingest_mtx);
+    while (ingest_len == INGEST_QUEUE)
+      pthread_cond_wait(&ingest_cond, &ingest_mtx);
+    ingest_ring[(ingest_head + ingest_len++) % INGEST_QUEUE] = strdup(path);
+    pthread_mutex_unlock(&ingest_mtx);
+  }
+
+  free(line);
+  if (fp)
+    fclose(fp);
+  __atomic_store_n(&ingesting, 0, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/* add streamed paths, for at most INGEST_BUDGET_NS so the ui stays
+ * responsive when they're coming in by the million. songs queue up work for
+ * the workers, so this waits for them when they're behind, which in turn
+ * makes the reader wait. ui thread only */
+static void collect_ingested(void) {
+  uint64_t start = now_ns();
+  char *path;
+
+  while (now_ns() - start < INGEST_BUDGET_NS
+      && workq_pending(&duration_q) < INGEST_MAX_JOBS
+      && LOAD(n_dedup_pending) < INGEST_MAX_JOBS) {
+    pthread_mutex_lock(&ingest_mtx);
+    if (ingest_len == 0) {
+      pthread_mutex_unlock(&ingest_mtx);
+      break;
+    }
+    path = ingest_ring[ingest_head];
+    ingest_head = (ingest_head + 1) % INGEST_QUEUE;
+    ingest_len--;
+    pthread_cond_signal(&ingest_cond);
+    pthread_mutex_unlock(&ingest_mtx);
+
+    playlist_add_file(path);
+    free(path);
+  }
+}
+
+/* <path> is NULL for stdin */
+static void start_ingest(char *path) {
+  pthread_t thr;
+
+  ingesting = 1;
+  pthread_create(&thr, NULL, ingest_stream, path);
+  pthread_detach(thr);
+}
+
+/* copies at most <n> bytes of a tag, without tabs and newlines, so it fits in
+ * a line of ~/.mpvq_library */
+static void copy_tag(char *dst, const char *src, size_t n) {
+  size_t i;
+
+  n = n < TAG_MAX - 1 ? n : TAG_MAX - 1;
+  for (i = 0; i < n && src[i]; ++i)
+    dst[i] = src[i] == '\t' || src[i] == '\n' || src[i] == '\r' ? ' ' : src[i];
+  dst[i] = 0;
+}
+
+static void set_tag(tags *t, const char *key, size_t keylen, const char *val,
+    size_t n) {
+  if (keylen == 5 && strncasecmp(key, "title", 5) == 0)
+    copy_tag(t->title, val, n);
+  else if (keylen == 6 && strncasecmp(key, "artist", 6) == 0)
+    copy_tag(t->artist, val, n);
+  else if (keylen == 5 && strncasecmp(key, "album", 5) == 0)
+    copy_tag(t->album, val, n);
+  else if (keylen == 4 && (strncasecmp(key, "date", 4) == 0
+        || strncasecmp(key, "year", 4) == 0) && n >= 4 && !t->year) {
+    char year[5] = { val[0], val[1], val[2], val[3], 0 };
+    t->year = atoi(year);
+  }
+}
+
+/* vorbis comments, as in flac and ogg files */
+static void parse_vorbis_comment(unsigned char *b, size_t n, tags *t) {
+  size_t off, len;
+  uint32_t count, i;
+  char *eq;
+
+  if (n < 8 || (off = 4 + (size_t)le32(b)) + 4 > n)
+    return;
+  count = le32(b + off);
+  off += 4;
+
+  for (i = 0; i < count && off + 4 <= n; ++i) {
+    len = le32(b + off);
+    off += 4;
+    if (len > n - off)
+      return;
+    if ((eq = memchr(b + off, '=', len)) != NULL)
+      set_tag(t, (char*)b + off, eq - (char*)b - off, eq + 1,
+          len - (eq - (char*)b - off) - 1);
+    off += len;
+  }
+}
+
+/* appends <c> as utf-8 */
+static size_t put_utf8(char *dst, uint32_t c) {
+  if (c < 0x80) {
+    dst[0] = c;
+    return 1;
+  } else if (c < 0x800) {
+    dst[0] = 0xc0 | c >> 6;
+    dst[1] = 0x80 | (c & 0x3f);
+    return 2;
+  }
+  dst[0] = 0xe0 | c >> 12;
+  dst[1] = 0x80 | (c >> 6 & 0x3f);
+  dst[2] = 0x80 | (c & 0x3f);
+  return 3;
+}
+
+/* text frame of an id3v2 tag to utf-8 */
+static void id3_text(unsigned char *b, size_t n, char *out) {
+  size_t i, o = 0;
+  int be = 0;
+  uint32_t c;
+
+  if (n < 1)
+    return;
+  switch (b[0]) {
+    case 0: /* latin-1 */
+      for (i = 1; i < n && b[i] && o < TAG_MAX - 4; ++i)
+        o += put_utf8(out + o, b[i]);
+      break;
+    case 1: /* utf-16 with a bom */
+    case 2: /* utf-16be */
+      i = 1;
+      be = b[0] == 2;
+      if (b[0] == 1 && n >= 3) {
+        be = b[1] == 0xfe;
+        i = 3;
+      }
+      for (; i + 1 < n && o < TAG_MAX - 4; i += 2) {
+        c = be ? b[i] << 8 | b[i + 1] : b[i + 1] << 8 | b[i];
+        if (!c)
+          break;
+        o += put_utf8(out + o, c >= 0xd800 && c < 0xe000 ? '?' : c);
+      }
+      break;
+    case 3: /* utf-8 */
+      for (i = 1; i < n && b[i] && o < TAG_MAX - 1; ++i)
+        out[o++] = b[i];
+      break;
+  }
+  out[o] = 0;
+  copy_tag(out, out, o);
+}
+
+static void read_id3v2(int fd, tags *t) {
+  unsigned char h[10], *b;
+  size_t size, off = 0, len;
+  int v;
+  char year[TAG_MAX];
+
+  if (pread(fd, h, 10, 0) != 10 || memcmp(h, "ID3", 3) != 0)
+    return;
+  v = h[3];
+  size = h[6] << 21 | h[7] << 14 | h[8] << 7 | h[9];
+  if (v != 3 && v != 4)
+    return;
+  /* the text frames usually come before the cover art, so a big tag is
+   * read up to TAG_READ_MAX, and parsed till the first frame crossing it */
+  if (size > TAG_READ_MAX)
+    size = TAG_READ_MAX;
+  if ((b = malloc(size)) == NULL || pread(fd, b, size, 10) != (ssize_t)size) {
+    free(b);
+    return;
+  }
+
+  while (off + 10 <= size && b[off]) {
+    len = v == 4 ? (size_t)(b[off + 4] << 21 | b[off + 5] << 14
+        | b[off + 6] << 7 | b[off + 7]) : be32(b + off + 4);
+    if (len > size - off - 10)
+      break;
+    if (memcmp(b + off, "TIT2", 4) == 0)
+      id3_text(b + off + 10, len, t->title);
+    else if (memcmp(b + off, "TPE1", 4) == 0)
+      id3_text(b + off + 10, len, t->artist);
+    else if (memcmp(b + off, "TALB", 4) == 0)
+      id3_text(b + off + 10, len, t->album);
+    else if (memcmp(b + off, "TYER", 4) == 0
+        || memcmp(b + off, "TDRC", 4) == 0) {
+      id3_text(b + off + 10, len, year);
+      if (!t->year)
+        t->year = atoi(year);
+    }
+    off += 10 + len;
+  }
+  free(b);
+}
+
+static void read_flac_tags(int fd, tags *t) {
+  unsigned char h[4], *b;
+  off_t off = skip_id3v2(fd);
+  size_t len;
+
+  if (pread(fd, h, 4, off) != 4 || memcmp(h, "fLaC", 4) != 0)
+    return;
+  off += 4;
+
+  do {
+    if (pread(fd, h, 4, off) != 4)
+      return;
+    len = h[1] << 16 | h[2] << 8 | h[3];
+    if ((h[0] & 0x7f) == 4 && len <= TAG_READ_MAX) {
+      if ((b = malloc(len)) != NULL && pread(fd, b, len, off + 4)
+          == (ssize_t)len)
+        parse_vorbis_comment(b, len, t);
+      free(b);
+      return;
+    }
+    off += 4 + len;
+  } while (!(h[0] & 0x80));
+}
+
+/* the comment header is the second packet. it's looked for in the first
+ * pages, which is where it is unless there's cover art before the tags */
+static void read_ogg_tags(int fd, tags *t) {
+  unsigned char *b, *p;
+  ssize_t n;
+
+  if ((b = malloc(TAG_READ_MAX)) == NULL)
+    return;
+  n = pread(fd, b, TAG_READ_MAX, 0);
+  if (n > 0 && ((p = memmem(b, n, "\x03vorbis", 7)) != NULL
+        || (p = memmem(b, n, "OpusTags", 8)) != NULL)) {
+    p += *p == 3 ? 7 : 8;
+    parse_vorbis_comment(p, b + n - p, t);
+  }
+  free(b);
+}
+
+/* year from a path like "artist/1994 - album/01.flac", 0 if there's none */
+static int year_from_path(char *path) {
+  char *p;
+  int y;
+
+  for (p = path; *p; ++p)
+    if (isdigit(*p) && isdigit(p[1]) && isdigit(p[2]) && isdigit(p[3])
+        && !isdigit(p[4]) && (p == path || !isdigit(p[-1]))
+        && (y = atoi(p)) >= 1900 && y <= 2099)
+      return y;
+  return 0;
+}
+
+static void read_tags(char *path, int fd, tags *t) {
+  char *ext = getext(path);
+
+  memset(t, 0, sizeof(tags));
+  if (ext && strcasecmp(ext, "flac") == 0)
+    read_flac_tags(fd, t);
+  else if (ext && strcasecmp(ext, "mp3") == 0)
+    read_id3v2(fd, t);
+  else if (ext && (strcasecmp(ext, "ogg") == 0
+        || strcasecmp(ext, "opus") == 0))
+    read_ogg_tags(fd, t);
+
+  if (!t->year)
+    t->year = year_from_path(path);
+}
+
+static int track_format(char *path) {
+  char *ext = getext(path);
+  int i;
+
+  if (ext)
+    for (i = 0; i < n_music_file_extensions; ++i)
+      if (strcasecmp(music_file_extensions[i], ext) == 0)
+        return i;
+  return 0;
+}
+
+static void library_cache_path(char *loc) {
+  snprintf(loc, PATH_MAX, "%s/.mpvq_library", getenv("HOME"));
+}
+
+static void library_index_path(char *loc) {
+  snprintf(loc, PATH_MAX, "%s/.mpvq_library.idx", getenv("HOME"));
+}
+
+static track *library_add(library *l, char *path, long long size,
+    long long mtime, double secs, tags *t) {
+  track *tr;
+
+  if (l->n >= l->cap) {
+    l->cap = l->cap ? l->cap * 2 : 1024;
+    l->tracks = realloc(l->tracks, sizeof(track) * l->cap);
   }
 
-  for (i = y1 + 1; i < y2; ++i) {
-    tb_set_cell(x1, i, e, TB_DEFAULT, TB_DEFAULT);
-    tb_set_cell(x2, i, w, TB_DEFAULT, TB_DEFAULT);
+  tr = &l->tracks[l->n++];
+  tr->path = arena_strdup(&l->strs, path);
+  tr->title = arena_strdup(&l->strs, t->title);
+  tr->artist = arena_strdup(&l->strs, t->artist);
+  tr->album = arena_strdup(&l->strs, t->album);
+  tr->size = size;
+  tr->mtime = mtime;
+  tr->secs = secs;
+  tr->year = t->year;
+  tr->format = track_format(path);
+
+  return tr;
+}
+
+static void free_library(library *l) {
+  if (!l)
+    return;
+
+  arena_free(&l->strs);
+  free(l->tracks);
+  free(l->by_year);
+  free(l->by_secs);
+  free(l->by_format);
+  free(l->postings);
+  free(l);
+}
+
+/* <size> <mtime> <seconds> <year> <path>\t<title>\t<artist>\t<album> */
+static library *read_library_cache(void) {
+  char loc[PATH_MAX], buf[PATH_MAX + 4 * TAG_MAX + 128], *p, *path;
+  long long size, mtime;
+  double secs;
+  library *l = calloc(1, sizeof(library));
+  tags t;
+  int n;
+  FILE *fp;
+
+  library_cache_path(loc);
+  if ((fp = fopen(loc, "r")) == NULL)
+    return l;
+
+  while (fgets(buf, sizeof(buf), fp)) {
+    buf[strcspn(buf, "\n")] = 0;
+    if (sscanf(buf, "%lld %lld %lf %d %n", &size, &mtime, &secs, &t.year,
+          &n) != 4)
+      continue;
+    p = buf + n;
+    path = strsep(&p, "\t");
+    copy_tag(t.title, p ? strsep(&p, "\t") : "", TAG_MAX);
+    copy_tag(t.artist, p ? strsep(&p, "\t") : "", TAG_MAX);
+    copy_tag(t.album, p ? p : "", TAG_MAX);
+    library_add(l, path, size, mtime, secs, &t);
+  }
+
+  fclose(fp);
+  return l;
+}
+
+static void write_library_cache(library *l) {
+  char loc[PATH_MAX], tmp[PATH_MAX + 4];
+  track *t;
+  FILE *fp;
+  int i;
+
+  library_cache_path(loc);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", loc);
+  if ((fp = fopen(tmp, "w")) == NULL)
+    return;
+
+  for (i = 0; i < l->n; ++i) {
+    t = &l->tracks[i];
+    fprintf(fp, "%lld %lld %.3f %d %s\t%s\t%s\t%s\n", t->size, t->mtime,
+        t->secs, t->year, t->path, t->title, t->artist, t->album);
+  }
+
+  if (fclose(fp) == 0)
+    rename(tmp, loc);
+  else
+    unlink(tmp);
+}
+
+/* the alphabet of the gram index is a-z, 0-9 and everything else */
+static int tri_sym(unsigned char c) {
+  c = tolower(c);
+  if (c >= 'a' && c <= 'z')
+    return c - 'a' + 1;
+  if (c >= '0' && c <= '9')
+    return c - '0' + 27;
+  return 0;
+}
+
+/* every character, pair and trigram of <s> into <out>, which has room for
+ * 3 * strlen(<s>). pairs and characters come after the trigrams in the
+ * index, so terms shorter than 3 can be looked up too. returns how many */
+static int grams(const char *s, int *out) {
+  int n = 0, a = -1, b = -1, c;
+
+  for (; *s; ++s) {
+    c = tri_sym(*s);
+    out[n++] = N_TRIGRAMS + 37 * 37 + c;
+    if (b >= 0)
+      out[n++] = N_TRIGRAMS + b * 37 + c;
+    if (a >= 0)
+      out[n++] = (a * 37 + b) * 37 + c;
+    a = b;
+    b = c;
+  }
+
+  return n;
+}
+
+/* the grams a term is looked up by: its trigrams, or all of it if it's
+ * shorter than that. returns how many */
+static int term_grams(const char *s, int *out) {
+  int n = 0, i, len = strlen(s);
+
+  if (len < 3) {
+    out[0] = len == 1 ? N_TRIGRAMS + 37 * 37 + tri_sym(s[0])
+      : N_TRIGRAMS + tri_sym(s[0]) * 37 + tri_sym(s[1]);
+    return 1;
+  }
+  for (i = 2; i < len; ++i)
+    out[n++] = (tri_sym(s[i - 2]) * 37 + tri_sym(s[i - 1])) * 37
+      + tri_sym(s[i]);
+
+  return n;
+}
+
+/* the text of a track that gets indexed: its path under -l and its tags */
+static char *track_text(track *t, int i) {
+  switch (i) {
+    case 0: return t->path + library_rootlen;
+    case 1: return t->title;
+    case 2: return t->artist;
+    case 3: return t->album;
+  }
+  return NULL;
+}
+
+static int track_compar(const void *v1, const void *v2) {
+  return strcmp(((track*)v1)->path, ((track*)v2)->path);
+}
+
+static int colent_compar(const void *v1, const void *v2) {
+  const colent *a = v1, *b = v2;
+
+  if (a->key != b->key)
+    return a->key < b->key ? -1 : 1;
+  return a->id - b->id;
+}
+
+/* what the columns are sorted by: 0 year, 1 seconds, 2 format */
+static double track_key(track *t, int key) {
+  return key == 0 ? t->year : key == 1 ? t->secs : t->format;
+}
+
+/* ids of the tracks, sorted by <key> */
+static int *build_column(library *l, int key) {
+  colent *c = malloc(sizeof(colent) * (l->n + 1));
+  int *ids = malloc(sizeof(int) * (l->n + 1)), i;
+
+  for (i = 0; i < l->n; ++i) {
+    c[i].id = i;
+    c[i].key = track_key(&l->tracks[i], key);
+  }
+  qsort(c, l->n, sizeof(colent), colent_compar);
+  for (i = 0; i < l->n; ++i)
+    ids[i] = c[i].id;
+
+  free(c);
+  return ids;
+}
+
+static int varint_len(uint32_t v) {
+  int n = 1;
+
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+static unsigned char *put_varint(unsigned char *p, uint32_t v) {
+  for (; v >= 0x80; v >>= 7)
+    *p++ = 0x80 | (v & 0x7f);
+  *p++ = v;
+  return p;
+}
+
+/* posting lists hold the ids of the tracks with a gram, each as the
+ * distance from the previous one - 1, in LEB128. two passes over all the
+ * text: one to size the lists, one to fill them */
+static void build_grams(library *l) {
+  int *last = malloc(sizeof(int) * N_GRAMS), *g, i, j, k, n;
+  uint32_t *pos = malloc(sizeof(uint32_t) * N_GRAMS);
+  size_t maxlen = PATH_MAX + 4 * TAG_MAX;
+  char *s;
+
+  g = malloc(sizeof(int) * 3 * maxlen);
+  memset(l->gram_count, 0, sizeof(l->gram_count));
+  memset(pos, 0, sizeof(uint32_t) * N_GRAMS);
+  for (i = 0; i < N_GRAMS; ++i)
+    last[i] = -1;
+
+  for (i = 0; i < l->n; ++i)
+    for (j = 0; (s = track_text(&l->tracks[i], j)) != NULL; ++j)
+      for (n = grams(s, g), k = 0; k < n; ++k)
+        if (last[g[k]] != i) {
+          pos[g[k]] += varint_len(i - last[g[k]] - 1);
+          l->gram_count[g[k]]++;
+          last[g[k]] = i;
+        }
+
+  l->gram_off[0] = 0;
+  for (i = 0; i < N_GRAMS; ++i) {
+    l->gram_off[i + 1] = l->gram_off[i] + pos[i];
+    pos[i] = l->gram_off[i];
+    last[i] = -1;
+  }
+  l->postings = malloc(l->gram_off[N_GRAMS] + 1);
+
+  for (i = 0; i < l->n; ++i)
+    for (j = 0; (s = track_text(&l->tracks[i], j)) != NULL; ++j)
+      for (n = grams(s, g), k = 0; k < n; ++k)
+        if (last[g[k]] != i) {
+          pos[g[k]] = put_varint(l->postings + pos[g[k]], i - last[g[k]] - 1)
+            - l->postings;
+          last[g[k]] = i;
+        }
+
+  free(g);
+  free(pos);
+  free(last);
+}
+
+static void build_library(library *l) {
+  qsort(l->tracks, l->n, sizeof(track), track_compar);
+  l->by_year = build_column(l, 0);
+  l->by_secs = build_column(l, 1);
+  l->by_format = build_column(l, 2);
+  build_grams(l);
+}
+
+/* the posting list of <g> into <out>. returns its length */
+static int decode_postings(library *l, int g, int *out) {
+  unsigned char *p = l->postings + l->gram_off[g],
+                *end = l->postings + l->gram_off[g + 1];
+  uint32_t gap;
+  int id = -1, n = 0, shift;
+
+  while (p < end) {
+    gap = 0;
+    shift = 0;
+    do {
+      gap |= (uint32_t)(*p & 0x7f) << shift;
+      shift += 7;
+    } while (*p++ & 0x80);
+    id += gap + 1;
+    out[n++] = id;
+  }
+
+  return n;
+}
+
+/* 1 if <a> and <b> (the same file) get the same place in the index */
+static int same_track(track *a, track *b) {
+  return a->year == b->year && a->secs == b->secs
+    && strcmp(a->title, b->title) == 0 && strcmp(a->artist, b->artist) == 0
+    && strcmp(a->album, b->album) == 0;
+}
+
+/* the column of <old> sorted by <key>, with the ids mapped to the ones in
+ * <l>, minus the tracks that are gone or changed, merged with the <fresh>
+ * ones */
+static int *update_column(library *l, library *old, int *old_ids, int *map,
+    char *fresh, int key) {
+  colent *c = malloc(sizeof(colent) * (l->n + 1)), o;
+  int *ids = malloc(sizeof(int) * (l->n + 1)), i, j = 0, k = 0, n = 0;
+
+  for (i = 0; i < l->n; ++i)
+    if (fresh[i]) {
+      c[n].id = i;
+      c[n++].key = track_key(&l->tracks[i], key);
+    }
+  qsort(c, n, sizeof(colent), colent_compar);
+
+  for (i = 0; i < l->n; ++i) {
+    while (j < old->n && map[old_ids[j]] < 0)
+      j++;
+    if (j < old->n) {
+      o.id = map[old_ids[j]];
+      o.key = track_key(&l->tracks[o.id], key);
+    }
+    if (k < n && (j == old->n || colent_compar(&c[k], &o) < 0))
+      ids[i] = c[k++].id;
+    else {
+      ids[i] = o.id;
+      j++;
+    }
+  }
+
+  free(c);
+  return ids;
+}
+
+/* builds the index of <l> from the one of <old>, the last scan, instead of
+ * from all the text again. the tracks that are in both and didn't change
+ * keep their place in the lists, with their ids moved by the tracks added
+ * and removed before them. the grams of the added and changed tracks get
+ * their ids merged in, the ones of removed and changed tracks have their
+ * old ids dropped. lists no changed track has a gram of are copied as they
+ * are, if no ids moved */
+static void update_library(library *l, library *old) {
+  int *map = malloc(sizeof(int) * (old->n + 1)), *last, *g, *ids, i, j, k,
+      n, c, shifted = 0;
+  char *fresh = calloc(l->n + 1, 1), *touched = calloc(N_GRAMS, 1), *s;
+  uint64_t *pairs = NULL;
+  size_t n_pairs = 0, cap_pairs = 0, cap, len = 0, p = 0;
+  int prev;
+
+  qsort(l->tracks, l->n, sizeof(track), track_compar);
+  for (i = j = 0; i < old->n || j < l->n;) {
+    c = i == old->n ? 1 : j == l->n ? -1
+      : strcmp(old->tracks[i].path, l->tracks[j].path);
+    if (c < 0)
+      map[i++] = -1;
+    else if (c > 0)
+      fresh[j++] = 1;
+    else if (same_track(&old->tracks[i], &l->tracks[j])) {
+      shifted |= i != j;
+      map[i++] = j++;
+    } else {
+      map[i++] = -1;
+      fresh[j++] = 1;
+    }
+  }
+
+  l->by_year = update_column(l, old, old->by_year, map, fresh, 0);
+  l->by_secs = update_column(l, old, old->by_secs, map, fresh, 1);
+  l->by_format = update_column(l, old, old->by_format, map, fresh, 2);
+
+  /* (gram << 32 | id) of every gram of the fresh tracks, and which grams
+   * the gone ones had */
+  last = malloc(sizeof(int) * N_GRAMS);
+  g = malloc(sizeof(int) * 3 * (PATH_MAX + 4 * TAG_MAX));
+  for (i = 0; i < N_GRAMS; ++i)
+    last[i] = -1;
+  for (i = 0; i < l->n; ++i)
+    if (fresh[i])
+      for (j = 0; (s = track_text(&l->tracks[i], j)) != NULL; ++j)
+        for (n = grams(s, g), k = 0; k < n; ++k)
+          if (last[g[k]] != i) {
+            if (n_pairs >= cap_pairs) {
+              cap_pairs = cap_pairs ? cap_pairs * 2 : 1024;
+              pairs = realloc(pairs, sizeof(uint64_t) * cap_pairs);
+            }
+            pairs[n_pairs++] = (uint64_t)g[k] << 32 | i;
+            touched[g[k]] = 1;
+            last[g[k]] = i;
+          }
+  for (i = 0; i < old->n; ++i)
+    if (map[i] < 0)
+      for (j = 0; (s = track_text(&old->tracks[i], j)) != NULL; ++j)
+        for (n = grams(s, g), k = 0; k < n; ++k)
+          touched[g[k]] = 1;
+  qsort(pairs, n_pairs, sizeof(uint64_t), u64_compar);
+
+  cap = old->gram_off[N_GRAMS] + 5 * n_pairs + 1;
+  l->postings = malloc(cap);
+  ids = malloc(sizeof(int) * (old->n + 1));
+  for (i = 0; i < N_GRAMS; ++i) {
+    l->gram_off[i] = len;
+    if (!shifted && !touched[i]) {
+      n = old->gram_off[i + 1] - old->gram_off[i];
+      if (len + n >= cap)
+        l->postings = realloc(l->postings, cap = (len + n) * 2);
+      memcpy(l->postings + len, old->postings + old->gram_off[i], n);
+      l->gram_count[i] = old->gram_count[i];
+      len += n;
+      continue;
+    }
+
+    /* the old list mapped, merged with the fresh ids of the gram */
+    n = decode_postings(old, i, ids);
+    l->gram_count[i] = 0;
+    prev = -1;
+    for (j = 0;;) {
+      while (j < n && map[ids[j]] < 0)
+        j++;
+      if (p < n_pairs && (int)(pairs[p] >> 32) == i
+          && (j == n || (int)(uint32_t)pairs[p] < map[ids[j]]))
+        c = (uint32_t)pairs[p++];
+      else if (j < n)
+        c = map[ids[j++]];
+      else
+        break;
+      if (len + 5 >= cap)
+        l->postings = realloc(l->postings, cap *= 2);
+      len = put_varint(l->postings + len, c - prev - 1) - l->postings;
+      l->gram_count[i]++;
+      prev = c;
+    }
+  }
+  l->gram_off[N_GRAMS] = len;
+
+  free(ids);
+  free(pairs);
+  free(g);
+  free(last);
+  free(touched);
+  free(fresh);
+  free(map);
+}
+
+/* what ~/.mpvq_library is now, to tell if an index was built from it */
+static int library_cache_stat(library_header *h) {
+  char loc[PATH_MAX];
+  struct stat st;
+
+  library_cache_path(loc);
+  if (stat(loc, &st) < 0)
+    return 0;
+  h->cache_size = st.st_size;
+  h->cache_mtime = st.st_mtime;
+  h->cache_ino = st.st_ino;
+  return 1;
+}
+
+/* saves the index of <l>, which has to be what was just written to
+ * ~/.mpvq_library, so the next start doesn't have to build it */
+static void write_library_index(library *l) {
+  char loc[PATH_MAX], tmp[PATH_MAX + 4];
+  library_header h;
+  FILE *fp;
+
+  memset(&h, 0, sizeof(h));
+  if (!library_cache_stat(&h))
+    return;
+  memcpy(h.magic, LIBRARY_MAGIC, sizeof(h.magic));
+  h.n = l->n;
+  h.n_postings = l->gram_off[N_GRAMS];
+
+  library_index_path(loc);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", loc);
+  if ((fp = fopen(tmp, "w")) == NULL)
+    return;
+
+  fwrite(&h, sizeof(h), 1, fp);
+  fwrite(l->by_year, sizeof(int), l->n, fp);
+  fwrite(l->by_secs, sizeof(int), l->n, fp);
+  fwrite(l->by_format, sizeof(int), l->n, fp);
+  fwrite(l->gram_off, sizeof(l->gram_off), 1, fp);
+  fwrite(l->gram_count, sizeof(l->gram_count), 1, fp);
+  fwrite(l->postings, 1, h.n_postings, fp);
+
+  if (fclose(fp) == 0)
+    rename(tmp, loc);
+  else
+    unlink(tmp);
+}
+
+/* loads the index saved for <l>, as just read from ~/.mpvq_library. returns
+ * 0 if there's none, or it's of another version of the cache */
+static int read_library_index(library *l) {
+  char loc[PATH_MAX];
+  library_header h, now;
+  FILE *fp;
+  int ok;
+
+  library_index_path(loc);
+  memset(&now, 0, sizeof(now));
+  if (!library_cache_stat(&now) || (fp = fopen(loc, "r")) == NULL)
+    return 0;
+
+  l->by_year = malloc(sizeof(int) * (l->n + 1));
+  l->by_secs = malloc(sizeof(int) * (l->n + 1));
+  l->by_format = malloc(sizeof(int) * (l->n + 1));
+  ok = fread(&h, sizeof(h), 1, fp) == 1
+    && memcmp(h.magic, LIBRARY_MAGIC, sizeof(h.magic)) == 0
+    && h.n == l->n && h.cache_size == now.cache_size
+    && h.cache_mtime == now.cache_mtime && h.cache_ino == now.cache_ino
+    && fread(l->by_year, sizeof(int), l->n, fp) == (size_t)l->n
+    && fread(l->by_secs, sizeof(int), l->n, fp) == (size_t)l->n
+    && fread(l->by_format, sizeof(int), l->n, fp) == (size_t)l->n
+    && fread(l->gram_off, sizeof(l->gram_off), 1, fp) == 1
+    && fread(l->gram_count, sizeof(l->gram_count), 1, fp) == 1
+    && l->gram_off[N_GRAMS] == h.n_postings
+    && (l->postings = malloc(h.n_postings + 1)) != NULL
+    && fread(l->postings, 1, h.n_postings, fp) == h.n_postings;
+  fclose(fp);
+
+  if (!ok) {
+    free(l->by_year);
+    free(l->by_secs);
+    free(l->by_format);
+    free(l->postings);
+    l->by_year = l->by_secs = l->by_format = NULL;
+    l->postings = NULL;
+  }
+  return ok;
+}
+
+/* 1 if every track of <l> is under -l, which the ones read from
+ * ~/.mpvq_library aren't if -l changed since */
+static int library_under_root(library *l) {
+  int i;
+
+  for (i = 0; i < l->n; ++i)
+    if (strncmp(l->tracks[i].path, library_root, library_rootlen - 1) != 0
+        || l->tracks[i].path[library_rootlen - 1] != '/')
+      return 0;
+  return 1;
+}
+
+/* gives <l> to the ui, which picks it up in collect_library() */
+static void library_handover(library *l) {
+  pthread_mutex_lock(&library_mtx);
+  free_library(library_next); /* the ui didn't get to it */
+  library_next = l;
+  pthread_mutex_unlock(&library_mtx);
+}
+
+/* walks -l, reusing the tags of the last scan for files that didn't change
+ * and reading the tags of the rest. the index only gets updated, saved and
+ * handed over to the ui if something did change. at start, the last
+ * scan is ~/.mpvq_library, and its saved index is handed over before the
+ * walk. again every LIBRARY_INTERVAL seconds */
+static void *library_scanner(void *_) {
+  char **dirs, *dir, path[PATH_MAX];
+  int n_dirs, cap_dirs, i, changed, fd, handed = 0;
+  struct dirent *de;
+  struct stat st;
+  library *old, *l;
+  htab known;
+  track *t;
+  tags tg;
+  DIR *dp;
+  (void)_;
+
+  lower_thread_priority();
+  old = read_library_cache();
+  if (old->n > 0 && library_under_root(old) && read_library_index(old)) {
+    library_handover(old);
+    handed = 1;
+  }
+
+  /* once handed over, <old> is the ui's, but it's only freed after a newer
+   * one gets handed over, so it can still be read here until then */
+  while (1) {
+    memset(&known, 0, sizeof(known));
+    for (i = 0; i < old->n; ++i)
+      hput(&known, old->tracks[i].path, &old->tracks[i]);
+
+    l = calloc(1, sizeof(library));
+    changed = 0;
+    cap_dirs = 16;
+    dirs = malloc(sizeof(char*) * cap_dirs);
+    n_dirs = 0;
+    dirs[n_dirs++] = strdup(library_root);
+    while (n_dirs > 0) {
+      dir = dirs[--n_dirs];
+      if ((dp = opendir(dir)) != NULL) {
+        while ((de = readdir(dp)) != NULL) {
+          if (de->d_name[0] == '.' || strpbrk(de->d_name, "\t\n"))
+            continue;
+          snprintf(path, PATH_MAX, "%s/%s", dir, de->d_name);
+          if (de->d_type == DT_DIR
+              || (de->d_type == DT_UNKNOWN && is_dir(path))) {
+            if (n_dirs >= cap_dirs) {
+              cap_dirs *= 2;
+              dirs = realloc(dirs, sizeof(char*) * cap_dirs);
+            }
+            dirs[n_dirs++] = strdup(path);
+          } else if (is_music_ext(de->d_name) && stat(path, &st) == 0) {
+            t = hget(&known, path);
+            if (t && t->size == st.st_size && t->mtime == st.st_mtime) {
+              strlcpy(tg.title, t->title, TAG_MAX);
+              strlcpy(tg.artist, t->artist, TAG_MAX);
+              strlcpy(tg.album, t->album, TAG_MAX);
+              tg.year = t->year;
+              library_add(l, path, t->size, t->mtime, t->secs, &tg);
+              continue;
+            }
+
+            changed = 1;
+            memset(&tg, 0, sizeof(tg));
+            if ((fd = open(path, O_RDONLY)) >= 0) {
+              read_tags(path, fd, &tg);
+              t = library_add(l, path, st.st_size, st.st_mtime,
+                  probe_header(path, fd, st.st_size), &tg);
+              close(fd);
+            }
+          }
+        }
+        closedir(dp);
+      }
+      free(dir);
+    }
+    free(dirs);
+
+    if (l->n != old->n)
+      changed = 1; /* something's gone */
+    hclear(&known, 0);
+
+    if (!changed && handed) /* the ui has this one already */
+      free_library(l);
+    else {
+      if (handed)
+        update_library(l, old);
+      else {
+        free_library(old);
+        build_library(l);
+      }
+      write_library_cache(l);
+      write_library_index(l);
+      library_handover(l);
+      old = l;
+      handed = 1;
+    }
+
+    sleep(LIBRARY_INTERVAL);
+  }
+
+  return NULL;
+}
+
+static void init_library(void) {
+  pthread_t thr;
+  char path[PATH_MAX];
+
+  if (realpath(library_root, path) == NULL)
+    err(1, "cannot use %s as the library", library_root);
+  library_root = strdup(path);
+  library_rootlen = strlen(path) + 1;
+
+  pthread_create(&thr, NULL, library_scanner, NULL);
+  pthread_detach(thr);
+}
+
+/* keeps the ids in <ids> that are in the posting list of <g>, decoding it
+ * only as far as the last of them. returns how many are left */
+static int intersect_postings(library *l, int g, int *ids, int n) {
+  unsigned char *p = l->postings + l->gram_off[g],
+                *end = l->postings + l->gram_off[g + 1];
+  uint32_t gap;
+  int id = -1, i = 0, c = 0, shift;
+
+  while (p < end && i < n) {
+    gap = 0;
+    shift = 0;
+    do {
+      gap |= (uint32_t)(*p & 0x7f) << shift;
+      shift += 7;
+    } while (*p++ & 0x80);
+    id += gap + 1;
+    while (i < n && ids[i] < id)
+      i++;
+    if (i < n && ids[i] == id)
+      ids[c++] = ids[i++];
+  }
+
+  return c;
+}
+
+/* a query term's grams as keys: how many tracks have the gram << 32, the
+ * gram << 8, the term. sorted, the rarest grams come first. returns how
+ * many */
+static int term_keys(library *l, qterm *q, int term, uint64_t *keys) {
+  int g[MODAL_BUFSZ], n = term_grams(q->text, g), i;
+
+  for (i = 0; i < n; ++i)
+    keys[i] = (uint64_t)l->gram_count[g[i]] << 32 | g[i] << 8 | term;
+
+  return n;
+}
+
+#define KEY_GRAM(k) ((int)((k) >> 8 & 0xffff))
+#define KEY_TERM(k) ((int)((k) & 0xff))
+
+/* ids of the tracks that have all the grams of <keys>, sorted, into <out>.
+ * lists a lot longer than what's left aren't worth decoding, the text gets
+ * matched anyway. returns how many, <applied> gets how many keys got used */
+static int gram_candidates(library *l, uint64_t *keys, int n_keys, int *out,
+    int *applied) {
+  int n, i;
+
+  n = decode_postings(l, KEY_GRAM(keys[0]), out);
+  for (i = 1; i < n_keys && n > 0; ++i) {
+    if ((keys[i] >> 32) > (uint64_t)n * GRAM_SKIP)
+      break;
+    if (KEY_GRAM(keys[i]) != KEY_GRAM(keys[i - 1])) /* in another term */
+      n = intersect_postings(l, KEY_GRAM(keys[i]), out, n);
+  }
+
+  *applied = i;
+  return n;
+}
+
+static double parse_secs(char *s) {
+  int m, sec;
+
+  if (sscanf(s, "%d:%d", &m, &sec) == 2)
+    return m * 60 + sec;
+  return atof(s);
+}
+
+/* "a..b", "a..", "..b" or just "a" */
+static int parse_range(char *s, double *lo, double *hi, int secs) {
+  char *dots = strstr(s, "..");
+
+  if (!*s)
+    return 0;
+  if (!dots) {
+    *lo = *hi = secs ? parse_secs(s) : atof(s);
+    return 1;
+  }
+
+  *dots = 0;
+  *lo = *s ? (secs ? parse_secs(s) : atof(s)) : -INFINITY;
+  *hi = dots[2] ? (secs ? parse_secs(dots + 2) : atof(dots + 2)) : INFINITY;
+  return 1;
+}
+
+/* splits <q> (in place) into terms: words, "quoted words", field:value,
+ * field:lo..hi, each of them negated with a leading -. returns how many, or
+ * -1 if one of them doesn't make sense */
+static int parse_query(char *q, qterm *terms, int max) {
+  static const char *fields[] = {
+    "", "path", "title", "artist", "album", "year", "dur", "format", "in"
+  };
+  char *tok, *out, *colon;
+  int n = 0, quoted, i;
+
+  while (*q && n < max) {
+    while (*q == ' ')
+      q++;
+    if (!*q)
+      break;
+
+    memset(&terms[n], 0, sizeof(qterm));
+    if (*q == '-') {
+      terms[n].neg = 1;
+      q++;
+    }
+    for (tok = out = q, quoted = 0; *q && (quoted || *q != ' '); ++q)
+      if (*q == '"')
+        quoted = !quoted;
+      else
+        *out++ = *q;
+    if (*q)
+      q++;
+    *out = 0;
+
+    terms[n].field = q_any;
+    terms[n].text = tok;
+    if ((colon = strchr(tok, ':')) != NULL)
+      for (i = 1; i < (int)(sizeof(fields) / sizeof(*fields)); ++i)
+        if ((size_t)(colon - tok) == strlen(fields[i])
+            && strncmp(tok, fields[i], colon - tok) == 0) {
+          terms[n].field = i;
+          terms[n].text = colon + 1;
+        }
+    if (!*terms[n].text)
+      continue;
+
+    switch (terms[n].field) {
+      case q_year:
+      case q_secs:
+        if (!parse_range(terms[n].text, &terms[n].lo, &terms[n].hi,
+              terms[n].field == q_secs))
+          return -1;
+        break;
+      case q_format:
+        terms[n].lo = terms[n].hi = -1;
+        for (i = 0; i < n_music_file_extensions; ++i)
+          if (strcasecmp(music_file_extensions[i], terms[n].text) == 0)
+            terms[n].lo = terms[n].hi = i;
+        if (terms[n].lo < 0)
+          return -1;
+        break;
+      case q_in:
+        if (strcmp(terms[n].text, "playlist") != 0)
+          return -1;
+        break;
+    }
+    n++;
+  }
+
+  return n;
+}
+
+static int term_matches(track *t, qterm *q) {
+  int m = 0, i;
+
+  switch (q->field) {
+    case q_any:
+      for (i = 0; i < 4 && !m; ++i)
+        m = strcasestr(track_text(t, i), q->text) != NULL;
+      break;
+    case q_path:
+    case q_title:
+    case q_artist:
+    case q_album:
+      m = strcasestr(track_text(t, q->field - q_path), q->text) != NULL;
+      break;
+    case q_year:
+      m = t->year && t->year >= q->lo && t->year <= q->hi;
+      break;
+    case q_secs:
+      m = t->secs >= 0 && t->secs >= q->lo && t->secs <= q->hi;
+      break;
+    case q_format:
+      m = t->format == q->lo;
+      break;
+    case q_in:
+      m = hget(&playlist_index, t->path) != NULL;
+      break;
   }
 
-  tb_print(x1 + 3, y1, TB_BLUE, TB_DEFAULT, title);
+  return m != q->neg;
 }
 
-static void handle_playpause(int change) {
-  if (change) {
-    if (pstate == state_playing) {
-      pstate = state_paused;
-      handle_playpause(0);
-    } else if (pstate == state_nothing_playing) {
-      pstate = state_playing;
-      play_song(playlist.elems[current_playing]);
-    } else {
-      pstate = state_playing;
-      play_song(NULL);
-      handle_playpause(0);
-    }
+static double column_key(library *l, int column, int id) {
+  switch (column) {
+    case q_year: return l->tracks[id].year;
+    case q_secs: return l->tracks[id].secs;
   }
+  return l->tracks[id].format;
 }
 
-static void draw_list(gui_list *l, int use_basename, int draw_cursor,
-    int draw_playing) {
-  int i,
-      maxlen = l->x2 - l->x1 - 1,
-      maxh = l->y2 - l->y1;
-  char *s;
-  uintattr_t bg, fg;
+/* first position in a column with a key >= <v> */
+static int column_bound(library *l, int column, int *ids, double v) {
+  int lo = 0, hi = l->n, mid;
 
-  assert(l->x2 > l->x1);
-  assert(l->y2 > l->y1);
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (column_key(l, column, ids[mid]) < v)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
 
-  for (i = 0; i < (l->n_elems > maxh ? maxh : l->n_elems); ++i) {
-    bg = fg = 0;
-    s = use_basename ? basename(l->elems[i + l->scroll]) :
-      strdup(l->elems[i + l->scroll]);
-    if ((int)strlen(s) > maxlen)
-      strcpy(s + maxlen - 4, "...");
+static int *column(library *l, int field) {
+  return field == q_year ? l->by_year : field == q_secs ? l->by_secs
+    : l->by_format;
+}
 
-    if (l->scroll + i == current_playing && draw_playing) {
-      if (pstate == state_playing)
-        fg = TB_GREEN;
-      else
-        fg = TB_RED;
-    }
-    if (draw_cursor && l->scroll + i == l->cur) {
-      bg = TB_DEFAULT | TB_REVERSE;
-      if (!fg)
-        fg = TB_DEFAULT | TB_REVERSE;
-    } else {
-      bg = TB_DEFAULT;
-      if (!fg)
-        fg = TB_DEFAULT;
-    }
+/* 1 if the tracks with the gram of <q> are exactly the ones it matches: a
+ * term of letters and digits short enough to be a single gram, looked for
+ * everywhere */
+static int term_exact(qterm *q) {
+  char *s;
+
+  if (q->field != q_any || strlen(q->text) > 3)
+    return 0;
+  for (s = q->text; *s; ++s)
+    if ((*s & 0x80) || !isalnum(*s))
+      return 0;
+  return 1;
+}
 
-    tb_print(l->x1, l->y1 + i,
-        fg, bg, use_basename ? basename(s) : s);
-    if (!use_basename)
-      free(s);
+/* id of the track at <path>, -1 if it isn't in the library */
+static int library_find(library *l, char *path) {
+  int lo = 0, hi = l->n - 1, mid, c;
+
+  while (lo <= hi) {
+    mid = (lo + hi) / 2;
+    if ((c = strcmp(l->tracks[mid].path, path)) == 0)
+      return mid;
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
   }
+  return -1;
 }
 
-static void playlist_add_song(char *apath) {
-  char *path = malloc(strlen(cwd) + strlen(apath) + 1),
-       songpath[PATH_MAX];
-  int i;
-  DIR *dp;
-  struct dirent *de;
+/* marks the tracks <q> (taken as not negated) matches, so the candidates
+ * can skip them. returns 0 if that's more work than checking it on the
+ * <n_cand> candidates instead */
+static int exclude_term(qterm *q, int term, int n_cand, uint64_t *keys) {
+  qterm pos = *q;
+  int lo, hi, *col, i, j, n, applied, exact;
+
+  pos.neg = 0;
+  switch (q->field) {
+    case q_year:
+    case q_secs:
+    case q_format:
+      col = column(lib, q->field);
+      lo = column_bound(lib, q->field, col, q->lo);
+      hi = column_bound(lib, q->field, col, nextafter(q->hi, INFINITY));
+      if (hi - lo > n_cand)
+        return 0;
+      for (i = lo; i < hi; ++i)
+        query_marks[col[i]] = query_gen;
+      return 1;
+    case q_in:
+      if (playlist.n_elems > n_cand)
+        return 0;
+      for (i = 0; i < playlist.n_elems; ++i)
+        if ((j = library_find(lib, playlist.elems[i])) >= 0)
+          query_marks[j] = query_gen;
+      return 1;
+  }
 
-  sprintf(path, "%s%s", cwd, apath);
-  realpath(path, path);
+  n = term_keys(lib, &pos, term, keys);
+  qsort(keys, n, sizeof(uint64_t), u64_compar);
+  if ((keys[0] >> 32) > (uint64_t)n_cand)
+    return 0;
+  exact = term_exact(&pos);
+  n = gram_candidates(lib, keys, n, tmp_buf, &applied);
+  for (i = 0; i < n; ++i)
+    if (exact || term_matches(&lib->tracks[tmp_buf[i]], &pos))
+      query_marks[tmp_buf[i]] = query_gen;
+  return 1;
+}
 
-  if (is_directory(apath)) {
-    dp = opendir(path);
+/* runs <query> over the library, the matches end up in the results pane.
+ * the candidates come from whichever index narrows them down the most: the
+ * grams of all the text terms, the sorted column of a range, or the
+ * playlist. what negated terms match gets marked and skipped. the terms
+ * that weren't answered exactly by that are checked on every candidate.
+ * returns 0 if the query doesn't parse */
+static int run_query(char *query) {
+  char buf[MODAL_BUFSZ], done[QUERY_TERMS] = { 0 };
+  qterm terms[QUERY_TERMS], *check[QUERY_TERMS];
+  uint64_t keys[MODAL_BUFSZ], start = now_ns();
+  int n_terms, n_keys = 0, i, j, k, n = 0, best = -1, best_n, lo, hi, *col,
+      *cand = NULL, n_cand, n_check;
+
+  strlcpy(buf, query, sizeof(buf));
+  if ((n_terms = parse_query(buf, terms, QUERY_TERMS)) < 0)
+    return 0;
+
+  if (lib->n > results_cap) {
+    results_cap = lib->n;
+    result_ids = realloc(result_ids, sizeof(int) * results_cap);
+    results.elems = realloc(results.elems, sizeof(char*) * results_cap);
+    cand_buf = realloc(cand_buf, sizeof(int) * results_cap);
+    tmp_buf = realloc(tmp_buf, sizeof(int) * results_cap);
+    query_marks = realloc(query_marks, sizeof(unsigned) * results_cap);
+    memset(query_marks, 0, sizeof(unsigned) * results_cap);
+  }
+  if (++query_gen == 0) { /* wrapped, old marks could pass for new ones */
+    memset(query_marks, 0, sizeof(unsigned) * results_cap);
+    query_gen = 1;
+  }
 
-    if (!dp) {
-      tb_deinit();
-      err(errno, "cannot opendir(%s)", path);
+  for (i = 0; i < n_terms; ++i)
+    if (!terms[i].neg && terms[i].field <= q_album)
+      n_keys += term_keys(lib, &terms[i], i, keys + n_keys);
+  qsort(keys, n_keys, sizeof(uint64_t), u64_compar);
+  best_n = n_keys ? (int)(keys[0] >> 32) : lib->n;
+  for (i = 0; i < n_terms; ++i) {
+    if (terms[i].field == q_in)
+      track_pending(0);
+    if (terms[i].neg)
+      continue;
+    switch (terms[i].field) {
+      case q_in:
+        j = playlist.n_elems;
+        break;
+      case q_year:
+      case q_secs:
+      case q_format:
+        col = column(lib, terms[i].field);
+        /* hi is inclusive */
+        j = column_bound(lib, terms[i].field, col, nextafter(terms[i].hi,
+              INFINITY)) - column_bound(lib, terms[i].field, col,
+              terms[i].lo);
+        break;
+      default:
+        continue;
     }
+    if (j < best_n) {
+      best_n = j;
+      best = i;
+    }
+  }
 
-    while ((de = readdir(dp)) != NULL) {
-      if (is_music_ext(de->d_name)) {
-        snprintf(songpath, PATH_MAX, "%s/%s", apath, de->d_name);
-        playlist_add_song(songpath);
-      }
+  if (best >= 0 && terms[best].field == q_in) {
+    cand = cand_buf;
+    for (i = n_cand = 0; i < playlist.n_elems; ++i)
+      if ((j = library_find(lib, playlist.elems[i])) >= 0)
+        cand[n_cand++] = j;
+    done[best] = 1;
+  } else if (best >= 0) {
+    col = column(lib, terms[best].field);
+    lo = column_bound(lib, terms[best].field, col, terms[best].lo);
+    hi = column_bound(lib, terms[best].field, col,
+        nextafter(terms[best].hi, INFINITY));
+    cand = col + lo;
+    n_cand = hi - lo;
+    done[best] = 1;
+  } else if (n_keys) {
+    cand = cand_buf;
+    n_cand = gram_candidates(lib, keys, n_keys, cand, &k);
+    for (i = 0; i < k; ++i)
+      if (term_exact(&terms[KEY_TERM(keys[i])]))
+        done[KEY_TERM(keys[i])] = 1;
+  } else /* nothing to go by, every track is a candidate */
+    n_cand = lib->n;
+
+  for (i = 0; i < n_terms; ++i)
+    if (terms[i].neg)
+      done[i] = exclude_term(&terms[i], i, n_cand, keys + n_keys);
+
+  for (i = n_check = 0; i < n_terms; ++i)
+    if (!done[i])
+      check[n_check++] = &terms[i];
+  for (i = 0; i < n_cand; ++i) {
+    j = cand ? cand[i] : i;
+    if (j < 0 || j >= lib->n || query_marks[j] == query_gen)
+      continue;
+    for (k = 0; k < n_check && term_matches(&lib->tracks[j], check[k]); ++k)
+      ;
+    if (k == n_check) {
+      result_ids[n] = j;
+      results.elems[n++] = lib->tracks[j].path + library_rootlen;
     }
+  }
 
-    return;
+  results.n_elems = n;
+  results.cur = results.scroll = 0;
+  query_ms = (now_ns() - start) / 1e6;
+  if (query != last_query) {
+    free(last_query);
+    last_query = strdup(query);
   }
 
-  /* check if song isn't already in the playlist */
-  for (i = 0; i < playlist.n_elems; ++i)
-    if (strcmp(path, playlist.elems[i]) == 0)
-      return;
+  return 1;
+}
 
-  playlist.elems = realloc(playlist.elems,
-      sizeof(char*) * (playlist.n_elems + 1));
-  playlist.elems[playlist.n_elems] = strdup(path);
-  playlist.n_elems++;
+/* takes the index over from the scanner, if it built a new one. ui thread
+ * only */
+static void collect_library(void) {
+  library *old;
 
-  free(path);
+  pthread_mutex_lock(&library_mtx);
+  old = lib;
+  if (library_next) {
+    lib = library_next;
+    library_next = NULL;
+  }
+  pthread_mutex_unlock(&library_mtx);
+
+  if (old == lib)
+    return;
+  /* the results point into the old one */
+  if (last_query)
+    run_query(last_query);
+  free_library(old);
 }
 
 static void draw_fileexplorer(void) {
@@ -424,14 +4670,12 @@ static void draw_fileexplorer(void) {
 
 static void init_fileexplorer() {
   fileexplorer.cur = 0;
-  fileexplorer.elems = NULL;
   fileexplorer.n_elems = 0;
   fileexplorer.scroll = 0;
 }
 
 static void init_playlist() {
   playlist.cur = 0;
-  playlist.elems = NULL;
   playlist.n_elems = 0;
   playlist.scroll = 0;
 }
@@ -462,7 +4706,7 @@ fully_redraw:
 
     /* wait for input */
     tb_present();
-    tb_poll_event(&ev);
+    poll_event(&ev, -1);
 
     switch (ev.type) {
       case TB_EVENT_RESIZE:
@@ -513,7 +4757,7 @@ fully_redraw:
 
     /* wait for input */
     tb_present();
-    tb_poll_event(&ev);
+    poll_event(&ev, -1);
 
     switch (ev.type) {
       case TB_EVENT_RESIZE:
@@ -543,13 +4787,14 @@ fully_redraw:
 static char *modal_input(char *title, char *text, char *hint) {
   int width, height, x1, x2, y1, y2, cur_opt = 1, max_text_w, max_text_h, i,
       lines, input_len;
-  char *buf = malloc(MODAL_BUFSZ), *buf_start = buf;
+  static char input[MODAL_BUFSZ]; /* valid until the next modal_input() */
+  char *buf = input, *buf_start = input;
   struct tb_event ev;
 
   memset(buf, 0, MODAL_BUFSZ);
   if (hint) {
-    memcpy(buf, hint, strlen(hint));
-    buf += strlen(hint);
+    strlcpy(buf, hint, MODAL_BUFSZ);
+    buf += strlen(buf);
   }
 fully_redraw:
   exit_if_term_to_small();
@@ -583,8 +4828,9 @@ fully_redraw:
 
     /* wait for input */
     tb_present();
-    tb_poll_event(&ev);
+    poll_event(&ev, -1);
 
+next_event:
     switch (ev.type) {
       case TB_EVENT_RESIZE:
         goto fully_redraw;
@@ -604,17 +4850,21 @@ fully_redraw:
             *buf = 0;
             break;
           default:
-            if (ev.ch)
+            if (ev.ch && buf < buf_start + MODAL_BUFSZ - 1)
               *buf++ = ev.ch;
             break;
         }
     }
+
+    /* a paste comes in as a burst of keys, draw once after all of them */
+    if (poll_event(&ev, 0) == TB_OK)
+      goto next_event;
   }
 }
 
 static void read_playlist(char *givenpath) {
-  char path[PATH_MAX], warnstr[2048], buf[PATH_MAX];
-  int i;
+  char path[PATH_MAX], warnstr[2048], buf[PATH_MAX], dir[PATH_MAX];
+  int i, n;
   FILE *fp;
 
   if (givenpath) {
@@ -622,7 +4872,7 @@ static void read_playlist(char *givenpath) {
     goto has_path;
   }
 
-  snprintf(path, PATH_MAX, "%s/%s", realpath(cwd, NULL),
+  snprintf(path, PATH_MAX, "%s/%s", realpath(cwd, dir) ? dir : cwd,
     fileexplorer.elems[fileexplorer.cur]);
   snprintf(warnstr, 2048, "are you sure you want to read %s and overwrite "
       "the current playlist?", path);
@@ -630,9 +4880,7 @@ static void read_playlist(char *givenpath) {
   if (!modal_yn("are you sure?", warnstr))
     return;
   if (playlist.n_elems > 0) {
-    for (i = 0; i < playlist.n_elems; ++i)
-      free(playlist.elems[i]);
-    free(playlist.elems);
+    clear_playlist();
 
 has_path: /* bit of a hack ig */
     init_playlist();
@@ -651,27 +4899,30 @@ has_path: /* bit of a hack ig */
 
   /* size */
   fgets(buf, PATH_MAX, fp);
-  playlist.n_elems = atoi(buf);
-  playlist.elems = malloc(sizeof(char*) * playlist.n_elems);
+  n = atoi(buf);
 
-  for (i = 0; i < playlist.n_elems; i++) {
+  for (i = 0; i < n; i++) {
     if (feof(fp))
       modal_alert("error", "this playlist file is corrupted");
 
     fgets(buf, PATH_MAX, fp);
-    playlist.elems[i] = strndup(buf, strlen(buf) - 1);
+    buf[strcspn(buf, "\n")] = 0;
+    if (!hget(&playlist_index, buf))
+      playlist_push(buf);
   }
 
   fclose(fp);
+  validate_playlist();
 }
 
 static void save_playlist() {
-  char *out;
+  char *out, dir[PATH_MAX];
   FILE *fp;
   int i;
 
   out = modal_input("save playlist to file",
-      "enter the desired playlist location:", realpath(cwd, NULL));
+      "enter the desired playlist location:",
+      realpath(cwd, dir) ? dir : cwd);
   if (out == NULL) return;
 
   fp = fopen(out, "w");
@@ -685,11 +4936,185 @@ static void save_playlist() {
   fclose(fp);
 }
 
+static void session_path(char *path) {
+  snprintf(path, PATH_MAX, "%s/.mpvq_session", getenv("HOME"));
+}
+
+/* remembers what the session file at <path> now holds */
+static void session_saved(char *path, session_header *h) {
+  struct stat st;
+
+  if (stat(path, &st) < 0)
+    return;
+  saved_header = *h;
+  session_ino = st.st_ino;
+  session_size = st.st_size;
+  session_dirty = 0;
+}
+
+/* when only the header changed, it's overwritten in place instead of
+ * writing all the lists again. returns 0 if the file isn't the one that was
+ * last written anymore */
+static int rewrite_session_header(char *path, session_header *h) {
+  struct stat st;
+  int fd, ok;
+
+  if ((fd = open(path, O_WRONLY)) < 0)
+    return 0;
+  ok = fstat(fd, &st) == 0 && st.st_ino == session_ino
+    && st.st_size == session_size
+    && pwrite(fd, h, sizeof(*h), 0) == sizeof(*h);
+  close(fd);
+  if (ok)
+    saved_header = *h;
+  return ok;
+}
+
+/* snapshot of everything needed to start where mpvq was left. written on
+ * exit and every SESSION_INTERVAL seconds, if anything changed */
+static void save_session(void) {
+  char path[PATH_MAX], tmp[PATH_MAX + 4];
+  session_header h;
+  FILE *fp;
+  int i;
+
+  last_session_save = time(NULL);
+  if (cwd == NULL)
+    return;
+
+  memset(&h, 0, sizeof(h)); /* padding too, it gets compared */
+  memcpy(h.magic, SESSION_MAGIC, sizeof(h.magic));
+  h.n_playlist = playlist.n_elems;
+  h.n_fileexplorer = fileexplorer.n_elems;
+  h.current_playing = current_playing;
+  h.pstate = pstate;
+  h.mode = current_mode;
+  h.playlist_cur = playlist.cur;
+  h.playlist_scroll = playlist.scroll;
+  h.fileexplorer_cur = fileexplorer.cur;
+  h.fileexplorer_scroll = fileexplorer.scroll;
+  h.time_pos = pstate == state_nothing_playing ? 0 : playing_pos();
+
+  session_path(path);
+  if (!session_dirty && (memcmp(&h, &saved_header, sizeof(h)) == 0
+        || rewrite_session_header(path, &h)))
+    return;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((fp = fopen(tmp, "w")) == NULL)
+    return;
+
+  fwrite(&h, sizeof(h), 1, fp);
+  fwrite(cwd, strlen(cwd) + 1, 1, fp);
+  for (i = 0; i < playlist.n_elems; ++i)
+    fwrite(playlist.elems[i], strlen(playlist.elems[i]) + 1, 1, fp);
+  for (i = 0; i < fileexplorer.n_elems; ++i)
+    fwrite(fileexplorer.elems[i], strlen(fileexplorer.elems[i]) + 1, 1, fp);
+
+  if (fclose(fp) == 0 && rename(tmp, path) == 0)
+    session_saved(path, &h);
+  else
+    unlink(tmp);
+}
+
+/* returns the next string of a session, NULL if it's cut short */
+static char *session_next(char **p, char *end) {
+  char *s = *p, *nul;
+
+  if (s >= end || (nul = memchr(s, 0, end - s)) == NULL)
+    return NULL;
+  *p = nul + 1;
+  return s;
+}
+
+/* points the first <n> elements of <l> at the next <n> strings of a session.
+ * returns 0 if it's cut short */
+static int session_list(gui_list *l, int n, char **p, char *end) {
+  int i;
+
+  if (n < 0)
+    return 0;
+  if (n > l->cap) {
+    l->cap = n;
+    l->elems = realloc(l->elems, sizeof(char*) * l->cap);
+  }
+  for (i = 0; i < n; ++i)
+    if ((l->elems[i] = session_next(p, end)) == NULL)
+      return 0;
+  l->n_elems = n;
+
+  return 1;
+}
+
+/* maps the session and points the lists right into it, which is the bulk of
+ * restoring it. the mapping stays until exit. returns 0 if there's no usable
+ * session. the rest is up to resume_session(), once mpv is up */
+static int restore_session(void) {
+  char path[PATH_MAX], *map, *p, *end, *str;
+  session_header h;
+  struct stat st;
+  int fd;
+
+  session_path(path);
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(h)
+      || (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+      == MAP_FAILED) {
+    close(fd);
+    return 0;
+  }
+  close(fd);
+
+  memcpy(&h, map, sizeof(h));
+  p = map + sizeof(h);
+  end = map + st.st_size;
+  if (memcmp(h.magic, SESSION_MAGIC, sizeof(h.magic)) != 0
+      || (str = session_next(&p, end)) == NULL
+      || !session_list(&playlist, h.n_playlist, &p, end)
+      || !session_list(&fileexplorer, h.n_fileexplorer, &p, end)) {
+    playlist.n_elems = fileexplorer.n_elems = 0;
+    munmap(map, st.st_size);
+    return 0;
+  }
+  cwd = strdup(str);
+
+  playlist.cur = h.playlist_cur < playlist.n_elems ? h.playlist_cur : 0;
+  playlist.scroll = h.playlist_scroll <= playlist.cur ? h.playlist_scroll : 0;
+  fileexplorer.cur = h.fileexplorer_cur < fileexplorer.n_elems ?
+    h.fileexplorer_cur : 0;
+  fileexplorer.scroll = h.fileexplorer_scroll <= fileexplorer.cur ?
+    h.fileexplorer_scroll : 0;
+  current_mode = h.mode == mode_playlist ? mode_playlist : mode_fileexplorer;
+  if (h.current_playing < playlist.n_elems) {
+    current_playing = h.current_playing;
+    pstate = h.pstate;
+    resume_pos = h.time_pos;
+  }
+  session_saved(path, &h);
+
+  return 1;
+}
+
+/* starts playing where the session was left. the per song work
+ * restore_session() skipped is done by the ui, see track_pending() */
+static void resume_session(void) {
+  const char *command_pause[] = { "set", "pause", "yes", NULL };
+
+  if (pstate == state_nothing_playing || playlist.n_elems == 0)
+    return;
+
+  if (pstate == state_paused)
+    mpv_cmd(command_pause);
+  play_entry(current_playing);
+}
+
 static void handle_fileexplorer(uint32_t c) {
   char buf[PATH_MAX] = { 0 };
   DIR *dir;
   struct dirent *de;
-  int maxl, i;
+  uint64_t start;
+  int maxl;
 
   if (cwd == NULL) { /* this will run only at start (or when jumped to),
                         when cwd is unset (or if need to change dir) */
@@ -700,6 +5125,7 @@ static void handle_fileexplorer(uint32_t c) {
 
     /* FIXME: spaghetti */
 change_dir:
+    start = metrics_path ? now_ns() : 0;
     dir = opendir(cwd);
     if (!dir) {
       tb_deinit();
@@ -707,30 +5133,23 @@ change_dir:
     }
 
     if (fileexplorer.n_elems > 0) {
-      for (i = 0; i < fileexplorer.n_elems; ++i)
-        free(fileexplorer.elems[i]);
-      free(fileexplorer.elems);
-
+      list_clear(&fileexplorer);
       init_fileexplorer();
     }
 
-    /* FIXE: this hurts to look at, fix how it's written or smth idk */
     while ((de = readdir(dir)) != NULL) {
       if (!(de->d_name[0] == '.' && de->d_name[1] != '.')) {
-        fileexplorer.elems = realloc(fileexplorer.elems,
-          sizeof(char*) * (fileexplorer.n_elems + 1));
-        fileexplorer.elems[fileexplorer.n_elems] =
-          malloc(strlen(de->d_name) + 2);
-        snprintf(fileexplorer.elems[fileexplorer.n_elems],
-          strlen(de->d_name) + 2, "%s%s", de->d_name,
+        snprintf(buf, PATH_MAX, "%s%s", de->d_name,
           is_directory(de->d_name) ? "/" : "");
-        fileexplorer.n_elems++;
+        list_push(&fileexplorer, buf);
       }
     }
 
     closedir(dir);
     mergesort(fileexplorer.elems, fileexplorer.n_elems, sizeof(char*),
         alphabetical);
+    if (metrics_path)
+      hist_observe(&dir_scan_hist, now_ns() - start);
   } else { /* normal program loop. interpret commands */
     switch (c) {
       BASIC_MOVEMENT(fileexplorer);
@@ -753,6 +5172,9 @@ change_dir:
           goto change_dir;
         }
         break;
+      case L'D':
+        start_find_duplicates(cwd);
+        break;
       case L'a':
         if (is_music_ext(fileexplorer.elems[fileexplorer.cur]) ||
             is_directory(fileexplorer.elems[fileexplorer.cur])) {
@@ -769,7 +5191,23 @@ change_dir:
 }
 
 static void draw_playlist(void) {
-  draw_outline("playlist", fileexplorer_width + 1, 0,
+  char title[128], total[32], left[32];
+  double rem;
+
+  collect_probes();
+  rem = playlist_durs.total - durlist_prefix(&playlist_durs,
+      current_playing < playlist_durs.n ? current_playing : playlist_durs.n)
+    - (pstate == state_nothing_playing ? 0 : playing_pos());
+  fmt_duration(total, sizeof(total), playlist_durs.total);
+  fmt_duration(left, sizeof(left), fmax(rem, 0));
+  if (playlist_durs.n_unknown)
+    snprintf(title, sizeof(title), "playlist %s, %s left (%d unknown)%s",
+        total, left, playlist_durs.n_unknown, wflag ? ", weighted" : "");
+  else
+    snprintf(title, sizeof(title), "playlist %s, %s left%s", total, left,
+        wflag ? ", weighted" : "");
+
+  draw_outline(title, fileexplorer_width + 1, 0,
     fileexplorer_width + playlist_width, tb_height() - 1);
   HANDLE_SCROLL(playlist);
   draw_list(&playlist, 1, current_mode == mode_playlist, 1);
@@ -779,31 +5217,40 @@ static void handle_playlist(uint32_t c) {
   switch (c) {
     BASIC_MOVEMENT(playlist);
     case L'R':
+      pthread_mutex_lock(&playlist_mtx);
       shuf((void**)playlist.elems, playlist.n_elems);
+      playlist_reordered();
+      pthread_mutex_unlock(&playlist_mtx);
       break;
     case L'l':
       pstate = state_playing;
-      current_playing = playlist.cur;
-      play_song(playlist.elems[current_playing]);
+      play_entry(playlist.cur);
       break;
     case L'r':
+      pthread_mutex_lock(&playlist_mtx);
       mergesort(playlist.elems, playlist.n_elems, sizeof(char*), alphabetical);
+      playlist_reordered();
+      pthread_mutex_unlock(&playlist_mtx);
       break;
     case L'K':
       if (playlist.cur > 0) {
-        swap((void**)&playlist.elems[playlist.cur],
-             (void**)&playlist.elems[playlist.cur - 1]);
+        pthread_mutex_lock(&playlist_mtx);
+        playlist_swap(playlist.cur, playlist.cur - 1);
         if (playlist.cur == current_playing)
           current_playing--;
+        prefetch_kick();
+        pthread_mutex_unlock(&playlist_mtx);
         playlist.cur--;
       }
       break;
     case L'J':
       if (playlist.cur + 1 < playlist.n_elems) {
-        swap((void**)&playlist.elems[playlist.cur],
-             (void**)&playlist.elems[playlist.cur + 1]);
+        pthread_mutex_lock(&playlist_mtx);
+        playlist_swap(playlist.cur, playlist.cur + 1);
         if (playlist.cur == current_playing)
           current_playing++;
+        prefetch_kick();
+        pthread_mutex_unlock(&playlist_mtx);
         playlist.cur++;
       }
       break;
@@ -811,7 +5258,10 @@ static void handle_playlist(uint32_t c) {
       search_buffer = modal_input("search", "enter search term", NULL);
       if (search_buffer == NULL)
         break;
+      pthread_mutex_lock(&playlist_mtx);
       qsort(playlist.elems, playlist.n_elems, sizeof(char*), search_compar);
+      playlist_reordered();
+      pthread_mutex_unlock(&playlist_mtx);
       break;
 
   }
@@ -819,13 +5269,63 @@ static void handle_playlist(uint32_t c) {
 }
 
 
-static void ui(void) {
-  struct tb_event ev;
+static void draw_library(void) {
+  char title[128];
 
-fully_redraw:
-  exit_if_term_to_small();
-  send_clear(); /* FIXME: this sucks */
+  if (lib)
+    snprintf(title, sizeof(title), "library: %d of %d songs (%.1fms)",
+        results.n_elems, lib->n, query_ms);
+  else
+    snprintf(title, sizeof(title), "library");
+  draw_outline(title, 0, 0, fileexplorer_width, tb_height() - 1);
+  HANDLE_SCROLL(results);
+  draw_list(&results, 0, current_mode == mode_library, 0);
+}
+
+static void handle_library(uint32_t c) {
+  int i;
+
+  switch (c) {
+    BASIC_MOVEMENT(results);
+    case L'a':
+      if (results.n_elems > 0)
+        playlist_add_file(lib->tracks[result_ids[results.cur]].path);
+      break;
+    case L'A':
+      for (i = 0; i < results.n_elems; ++i)
+        playlist_add_file(lib->tracks[result_ids[i]].path);
+      break;
+    case L'h':
+      current_mode = mode_fileexplorer;
+      break;
+  }
+}
+
+static void query_library(void) {
+  char *q;
 
+  if (!library_root) {
+    modal_alert("library", "there's no library. start mpvq with -l dir");
+    return;
+  }
+  collect_library();
+  if (!lib) {
+    modal_alert("library", "the library is still being indexed");
+    return;
+  }
+
+  q = modal_input("query the library", "e.g. artist:\"pink floyd\" "
+      "year:1970..1979 format:flac -in:playlist", last_query);
+  if (q == NULL)
+    return;
+  if (!run_query(q)) {
+    modal_alert("error", "cannot parse the query");
+    return;
+  }
+  current_mode = mode_library;
+}
+
+static void layout(void) {
   fileexplorer_width = FILEEXPLORER_RATIO * (float)(tb_width() - 1);
   playlist_width = PLAYLIST_RATIO * (float)(tb_width() - 1);
 
@@ -839,65 +5339,202 @@ fully_redraw:
   playlist.x2 = fileexplorer_width + playlist_width - 2;
   playlist.y2 = tb_height() - 1;
 
-  /*draw_fileexplorer();*/
-  /*draw_playlist();*/
+  results.x1 = fileexplorer.x1;
+  results.y1 = fileexplorer.y1;
+  results.x2 = fileexplorer.x2;
+  results.y2 = fileexplorer.y2;
+}
 
-  while (1) {
-    tb_clear();
+static void render(void) {
+  uint64_t start = metrics_path ? now_ns() : 0;
+
+  arena_reset(&frame);
+  tb_clear();
+  if (current_mode == mode_library)
+    draw_library();
+  else
     handle_fileexplorer(0);
-    handle_playlist(0);
-    tb_present();
+  handle_playlist(0);
+  tb_present();
 
-    tb_poll_event(&ev);
-    switch (ev.type) {
-      case TB_EVENT_RESIZE:
-        goto fully_redraw;
+  if (metrics_path)
+    hist_observe(&render_hist, now_ns() - start);
+}
+
+/* returns 0 if mpvq should exit */
+static int handle_key(struct tb_event *ev) {
+  int next;
+
+  switch (ev->key) {
+    case TB_KEY_CTRL_C:
+      return 0;
+    case TB_KEY_TAB:
+      current_mode = current_mode == mode_playlist ? mode_fileexplorer :
+        mode_playlist;
+      break;
+    default: /* it's not a special key, handle it normally */
+      switch (ev->ch) {
+        case L' ':
+          handle_playpause(1);
+          if (pstate == state_playing)
+            play_song(NULL);
+          else
+            pause_song();
+          break;
+        case L's':
+          save_playlist();
+          break;
+        case L'q':
+          return 0;
+        case L'w':
+          pthread_mutex_lock(&playlist_mtx);
+          wflag = !wflag;
+          next_pick = wflag ? shuffle_pick() : -1;
+          prefetch_kick();
+          pthread_mutex_unlock(&playlist_mtx);
+          break;
+        case L'f':
+          query_library();
+          break;
+        case L'n':
+          pthread_mutex_lock(&playlist_mtx);
+          if ((next = next_song()) >= 0) {
+            COUNT(n_skipped);
+            song_event("SKIP", playlist.elems[current_playing]);
+            current_playing = next;
+            play_song(playlist.elems[current_playing]);
+          }
+          pthread_mutex_unlock(&playlist_mtx);
+          break;
+        case L'N':
+          track_pending(0);
+          pthread_mutex_lock(&playlist_mtx);
+          if ((next = prev_song()) >= 0) {
+            current_playing = next;
+            play_song(playlist.elems[current_playing]);
+          }
+          pthread_mutex_unlock(&playlist_mtx);
+          break;
+        default:
+          if (current_mode == mode_fileexplorer)
+            handle_fileexplorer(ev->ch);
+          else if (current_mode == mode_library)
+            handle_library(ev->ch);
+          else
+            handle_playlist(ev->ch);
+      }
+      break;
+  }
+
+  return 1;
+}
+
+static int is_move(struct tb_event *ev) {
+  return ev->type == TB_EVENT_KEY && ev->key == 0 && ev->mod == 0
+    && (ev->ch == L'j' || ev->ch == L'k');
+}
+
+/* same as <n> presses of j (or -<n> of k), at once */
+static void move_cursor(int n) {
+  gui_list *l = current_mode == mode_fileexplorer ? &fileexplorer
+    : current_mode == mode_library ? &results : &playlist;
+
+  l->cur += n;
+  if (l->cur >= l->n_elems)
+    l->cur = l->n_elems - 1;
+  if (l->cur < 0)
+    l->cur = 0;
+}
+
+/* handles <ev>, then everything that comes in until <deadline> (or already
+ * waiting, but for at most FRAME_BUDGET_NS), so a held key or a paste is
+ * drawn once per frame instead of once per key. runs of j or k are applied
+ * as one move. returns 0 if mpvq should exit, -1 if the terminal got
+ * resized */
+static int handle_events(struct tb_event *ev, uint64_t deadline) {
+  uint64_t t = now_ns(), hard = t + FRAME_BUDGET_NS;
+  int moves = 0, rv = 1;
+
+  if (hard < deadline)
+    hard = deadline;
+  while (1) {
+    if (ev->type == TB_EVENT_RESIZE) {
+      rv = -1;
+      break;
+    }
+    if (is_move(ev)) {
+      /* j at the bottom followed by k isn't the same as doing nothing */
+      if ((ev->ch == L'j') != (moves > 0)) {
+        move_cursor(moves);
+        moves = 0;
+      }
+      moves += ev->ch == L'j' ? 1 : -1;
+    } else if (ev->type == TB_EVENT_KEY) {
+      move_cursor(moves);
+      moves = 0;
+      if (!handle_key(ev)) {
+        rv = 0;
         break;
-      case TB_EVENT_KEY:
-        switch (ev.key) {
-          case TB_KEY_CTRL_C:
-            goto finish;
-            break;
-          case TB_KEY_TAB:
-            current_mode = current_mode == mode_fileexplorer ? mode_playlist :
-              mode_fileexplorer;
-            break;
-          default: /* it's not a special key, handle it normally */
-            switch (ev.ch) {
-              case L' ':
-                handle_playpause(1);
-                if (pstate == state_playing)
-                  play_song(NULL);
-                else
-                  pause_song();
-                break;
-              case L's':
-                save_playlist();
-                break;
-              case L'q':
-                goto finish;
-                break;
-              case L'n':
-                if (current_playing + 1 < playlist.n_elems) {
-                  histwrite("SKIP %s", playlist.elems[current_playing]);
-                  current_playing++;
-                  play_song(playlist.elems[current_playing]);
-                }
-                break;
-              case L'N':
-                if (current_playing - 1 >= 0) {
-                  current_playing--;
-                  play_song(playlist.elems[current_playing]);
-                }
-                break;
-              default:
-                if (current_mode == mode_fileexplorer)
-                  handle_fileexplorer(ev.ch);
-                else
-                  handle_playlist(ev.ch);
-            }
-            break;
-        }
+      }
+    }
+
+    t = now_ns();
+    if (t >= hard
+        || poll_event(ev, t < deadline ? (deadline - t) / 1000000 : 0) != TB_OK)
+      break;
+  }
+  move_cursor(moves);
+
+  return rv;
+}
+
+static void ui(void) {
+  struct tb_event ev;
+  uint64_t last_frame;
+  int report;
+
+fully_redraw:
+  exit_if_term_to_small();
+  send_clear(); /* FIXME: this sucks */
+  layout();
+
+  while (1) {
+    pthread_mutex_lock(&hash_mtx);
+    report = dup_report_ready;
+    dup_report_ready = 0;
+    pthread_mutex_unlock(&hash_mtx);
+    if (report)
+      modal_alert("duplicates", dup_report);
+
+    if (LOAD(ingesting) || LOAD(ingest_len))
+      collect_ingested();
+    if (LOAD(n_dedup_pending))
+      collect_dedup();
+    if (gflag)
+      feed_loudness();
+    if (playlist_durs.n < playlist.n_elems)
+      track_pending(INGEST_BUDGET_NS);
+    if (library_root)
+      collect_library();
+    if (time(NULL) - last_session_save >= SESSION_INTERVAL)
+      save_session();
+    if (time(NULL) - last_validate >= VALIDATE_INTERVAL)
+      validate_playlist();
+    render();
+    last_frame = now_ns();
+
+    /* wake up every now and then, so durations and the time left get redrawn
+     * even when nothing's pressed */
+    if (poll_event(&ev, LOAD(ingesting) || LOAD(ingest_len)
+          || LOAD(n_dedup_pending) || playlist_durs.n < playlist.n_elems
+          ? INGEST_TICK_MS : UI_TICK_MS)
+        != TB_OK)
+      continue;
+    switch (handle_events(&ev, last_frame + FRAME_BUDGET_NS)) {
+      case -1:
+        goto fully_redraw;
+      case 0:
+        goto finish;
     }
   }
 
@@ -905,8 +5542,85 @@ finish:
   tb_deinit();
 }
 
+/* -b: run a fixed stream of movement keys through the same code the ui uses,
+ * over a big playlist, and fail if any frame after the warmup allocated */
+static int bench(void) {
+  static const char *keys = "jjjjjjjjjjjjjjjjjjjjkkkkkkkkkkGgjjjjjjjjjjjjG\t";
+  char buf[PATH_MAX];
+  struct tb_event ev = { 0 };
+  struct timespec start, end;
+  unsigned long allocs = 0;
+  double secs;
+  int i;
+
+  for (i = 0; i < BENCH_SONGS; ++i) {
+    snprintf(buf, PATH_MAX, "/mpvq-bench/%06d.flac", i);
+    playlist_push(buf);
+  }
+
+  exit_if_term_to_small();
+  layout();
+  for (i = 0; i < BENCH_WARMUP + BENCH_FRAMES; ++i) {
+    if (i == BENCH_WARMUP) {
+      allocs = n_allocs;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    ev.type = TB_EVENT_KEY;
+    ev.ch = keys[i % strlen(keys)];
+    ev.key = ev.ch == '\t' ? TB_KEY_TAB : 0;
+    ev.ch = ev.key ? 0 : ev.ch;
+    handle_key(&ev);
+    render();
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  allocs = n_allocs - allocs;
+  tb_deinit();
+
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%d frames in %.3fs (%.1fus per frame), %lu allocations\n",
+      BENCH_FRAMES, secs, secs * 1e6 / BENCH_FRAMES, allocs);
+
+  return allocs != 0;
+}
+
+/* -R: feed a recording through the ui as fast as possible, timing handling
+ * and drawing of every event separately. poll_event() prints the report and
+ * exits after the last one */
+static void replay(void) {
+  struct tb_event ev;
+  uint64_t start, last_frame;
+
+  exit_if_term_to_small();
+  layout();
+  render();
+  last_frame = now_ns();
+
+  while (1) {
+    poll_event(&ev, -1);
+
+    start = now_ns();
+    switch (handle_events(&ev, last_frame + FRAME_BUDGET_NS)) {
+      case -1:
+        layout();
+        break;
+      case 0:
+        replay_pos = n_replay_evs; /* the rest would've never been read */
+        break;
+    }
+    handle_lat[n_lat] = now_ns() - start;
+
+    start = now_ns();
+    render();
+    last_frame = now_ns();
+    render_lat[n_lat++] = last_frame - start;
+  }
+}
+
 static void usage() {
-  fprintf(stderr, "usage: %s [-hna] [file.plist]\n", argv0);
+  fprintf(stderr, "usage: %s [-hnagdb0] [-p n] [-m metrics.prom] "
+      "[-w plays,skips,age] [-l library] [-r events | -R events] "
+      "[file.plist | fifo | -]\n", argv0);
   exit(1);
 }
 
@@ -915,14 +5629,48 @@ int main(int argc, char *argv[]) {
   pthread_t *mpvthr;
 
   argv0 = *argv;
-  while ((c = getopt(argc, argv, "anh")) != -1) {
+  while ((c = getopt(argc, argv, "angdb0p:m:r:R:w:l:h")) != -1) {
     switch (c) {
       case 'a':
         aflag = 1;
         break;
+      case 'g':
+        gflag = 1;
+        break;
+      case 'd':
+        dflag = 1;
+        break;
+      case 'p':
+        prefetch_count = atoi(optarg);
+        break;
+      case 'b':
+        bflag = 1;
+        break;
+      case 'm':
+        metrics_path = optarg;
+        break;
+      case 'r':
+        record_path = optarg;
+        break;
+      case 'R':
+        replay_path = optarg;
+        nflag = 1; /* a replay shouldn't end up in the history */
+        break;
       case 'n':
         nflag = 1;
         break;
+      case 'l':
+        library_root = optarg;
+        break;
+      case 'w':
+        if (sscanf(optarg, "%lf,%lf,%lf", &weight_plays, &weight_skips,
+              &weight_age) != 3)
+          usage();
+        wflag = 1;
+        break;
+      case '0':
+        zflag = 1;
+        break;
       case 'h':
       default:
         usage();
@@ -931,11 +5679,43 @@ int main(int argc, char *argv[]) {
 
   init_fileexplorer();
   init_playlist();
-
-  tb_init();
+  init_durations();
+  init_validation();
+  if (dflag)
+    init_dedup();
+  if (library_root)
+    init_library();
+  if (gflag)
+    init_loudness();
+  if (prefetch_count)
+    init_prefetch();
+  if (metrics_path)
+    init_metrics();
+
+  if (replay_path) {
+    int w, h;
+    read_recording(&w, &h);
+    init_headless(w, h);
+  } else if (bflag)
+    init_headless(HEADLESS_WIDTH, HEADLESS_HEIGHT);
+  else
+    tb_init();
   tb_hide_cursor();
 
-  if (argv[optind] != NULL) {
+  if (bflag)
+    return bench();
+  if (record_path)
+    start_recording();
+
+  if (argv[optind] != NULL && strcmp(argv[optind], "-") == 0)
+    start_ingest(NULL);
+  else if (argv[optind] != NULL && is_fifo(argv[optind])) {
+    if (access(argv[optind], R_OK) < 0) {
+      tb_deinit();
+      err(errno, "cannot open %s", argv[optind]);
+    }
+    start_ingest(argv[optind]);
+  } else if (argv[optind] != NULL) {
     char *path = NULL;
     if (is_dir(argv[optind])) {
       path = alloca(strlen(argv[optind]) + strlen("mpvq.plist") + 2);
@@ -944,16 +5724,33 @@ int main(int argc, char *argv[]) {
       path = argv[optind];
 
     read_playlist(path);
-  }
+  } else if (!replay_path && stdin_is_pipe())
+    start_ingest(NULL);
+  else if (!replay_path)
+    restore_session();
 
 #if RAND_FUNCTION == rand
   srand(time(0));
 #endif
 
+  if (replay_path)
+    replay(); /* doesn't return */
+
   mpvthr = init_mpv();
+  resume_session();
+  last_session_save = time(NULL);
   ui();
+  save_session();
 
   pthread_cancel(*mpvthr);
   mpv_terminate_destroy(ctx);
+  if (record_fp)
+    fclose(record_fp);
+  if (metrics_path)
+    write_metrics();
+
+  if (LOAD(n_warm_starts) + LOAD(n_cold_starts) > 0)
+    printf("%d of %d songs started without waiting for the disk\n",
+        LOAD(n_warm_starts), LOAD(n_warm_starts) + LOAD(n_cold_starts));
   return 0;
 }